@@ -32,12 +32,59 @@ extern "C" {
 #include <libavcodec/avcodec.h>
 
 #include <libavutil/common.h>
+#include <libavutil/cpu.h>
+#include <libavutil/crc.h>
+#include <libavutil/dict.h>
 #include <libavutil/imgutils.h>
 #include <libavutil/intreadwrite.h>
+#include <libavutil/mem.h>
+#include <libavutil/opt.h>
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(55, 28, 100)
+#include <libavutil/mastering_display_metadata.h>
+#endif
 #ifdef __cplusplus
 }
 #endif
 
+#include <limits.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#if defined(AV_PIX_FMT_GBRPF32)
+#define HAVE_FLOAT_OUTPUT   1
+#else
+#define HAVE_FLOAT_OUTPUT   0
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__SSE2__))
+#include <emmintrin.h>
+#define HAVE_SSE2_INTRINSICS 1
+#else
+#define HAVE_SSE2_INTRINSICS 0
+#endif
+
+#if HAVE_SSE2_INTRINSICS && (defined(__clang__) || __GNUC__ >= 5)
+#include <immintrin.h>
+#define HAVE_AVX2_INTRINSICS 1
+#else
+#define HAVE_AVX2_INTRINSICS 0
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON_INTRINSICS 1
+#else
+#define HAVE_NEON_INTRINSICS 0
+#endif
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#define HAVE_HUGE_PAGES     1
+#else
+#define HAVE_HUGE_PAGES     0
+#endif
+
 #include <libde265/de265.h>
 
 #if !defined(LIBDE265_NUMERIC_VERSION) || LIBDE265_NUMERIC_VERSION < 0x00060000
@@ -51,20 +98,171 @@ extern "C" {
 
 #include "libde265dec.h"
 
+// Planar float output needs libavutil >= 56.19 (AV_PIX_FMT_GBRPF32), only
+// the AV_CODEC_CAP_* names exist in libavcodec 58 that comes with it.
+#if !defined(CODEC_CAP_DELAY)
+#define CODEC_CAP_DELAY         AV_CODEC_CAP_DELAY
+#define CODEC_CAP_AUTO_THREADS  AV_CODEC_CAP_AUTO_THREADS
+#define CODEC_CAP_DR1           AV_CODEC_CAP_DR1
+#define CODEC_CAP_SLICE_THREADS AV_CODEC_CAP_SLICE_THREADS
+#endif
+
 #define MAX_FRAME_QUEUE     16
 #define MAX_SPEC_QUEUE      16
+#define MAX_OPTIONS         64
+#define MAX_LOOKAHEAD       32
+#define MAX_RING_SLOTS      64
+#define MIN_BAND_HEIGHT     64
+
+#define COPY_PLANE          0
+#define COPY_SHIFT_RIGHT    1
+#define COPY_SHIFT_LEFT     2
+#define COPY_EXPAND_8BIT    3
+
+#define OUTPUT_YUV          0
+#define OUTPUT_RGB24        1
+#define OUTPUT_GBRPF32      2
+
+#define MATRIX_AUTO         0
+#define MATRIX_BT601        1
+#define MATRIX_BT709        2
+#define MATRIX_BT2020       3
+
+#define RANGE_AUTO          0
+#define RANGE_LIMITED       1
+#define RANGE_FULL          2
+
+// fractional bits of the fixed point RGB conversion
+#define CONVERT_BITS        20
+#define MAX_PPS_COUNT       64
+#define MAX_SHORT_TERM_RPS  64
+#define MAX_DELTA_POCS      16
+#define HUGE_PAGE_SIZE      (2 * 1024 * 1024)
+
+// Use the level of AVCodecContext.skip_loop_filter.
+#define DISCARD_AUTO            -100
+
+#define HUGE_PAGES_OFF          0
+#define HUGE_PAGES_TRANSPARENT  1
+#define HUGE_PAGES_EXPLICIT     2
+
+// Only the part up to the slice type is parsed from slice headers.
+#define MAX_SLICE_HEADER_SIZE   32
+
+#define NAL_UNIT_BLA_W_LP       16
+#define NAL_UNIT_RSV_IRAP_23    23
+#define NAL_UNIT_VPS            32
+#define NAL_UNIT_SPS            33
+#define NAL_UNIT_PPS            34
+#define NAL_UNIT_PREFIX_SEI     39
+
+#define SEI_TIME_CODE                       136
+#define SEI_MASTERING_DISPLAY_COLOUR_VOLUME 137
+#define SEI_CONTENT_LIGHT_LEVEL_INFO        144
 
 #define LIBDE265_FFMPEG_MAX(a, b)  ((a) > (b) ? (a) : (b))
 #define LIBDE265_FFMPEG_MIN(a, b)  ((a) < (b) ? (a) : (b))
 
+// Information about the pictures started in the current packet.
+typedef struct DE265AccessUnit {
+    int pictures;
+    int nal_unit_type;
+    int slice_type;
+    // bit mask of the VPS / SPS / PPS types in the packet and their checksums
+    int param_sets;
+    uint32_t param_set_crc[3];
+} DE265AccessUnit;
+
+// Slot of the picture ring provided by the application.
+typedef struct DE265RingSlot {
+    uint8_t *data;
+    // referenced by libde265 or frames returned by the decoder, cleared by
+    // the buffer free callback on any thread (access with load_acquire /
+    // store_release)
+    int decoding;
+    // returned by libde265dec_receive_ring_frames and not released yet
+    int completed;
+    int width;
+    int height;
+    int crop_left;
+    int crop_top;
+} DE265RingSlot;
+
 typedef struct DE265DecoderContext {
+    const AVClass *av_class;
     de265_decoder_context* decoder;
 
     int check_extra;
     int packetized;
     int length_size;
+    int huge_pages;
+    int skip_deblocking;
+    int skip_sao;
+    int lookahead;
+    int output_format;
+    int matrix;
+    int range;
+    // packets pushed to libde265 whose pictures haven't been returned yet
+    int pending_packets;
+
+    // parse-only probing
+    int probe;
+    AVFrame *probe_frame;
+    DE265AccessUnit au;
+    uint8_t *rbsp_buffer;
+    unsigned int rbsp_buffer_size;
+    int pps_extra_slice_header_bits[MAX_PPS_COUNT];
+    int mastering_present;
+    uint16_t mastering_primaries[3][2];
+    uint16_t mastering_white_point[2];
+    uint32_t mastering_max_luminance;
+    uint32_t mastering_min_luminance;
+    int light_level_present;
+    int max_content_light_level;
+    int max_pic_average_light_level;
+    char timecode[32];
+
+    // Annex-B NAL unit continuing in the next packet
+    int nal_pending;
+    uint8_t *nal_buffer;
+    unsigned int nal_buffer_size;
+    int nal_buffer_len;
+    int64_t nal_pts;
+
+    // RGB output
+    int32_t *convert_buffer;
+    unsigned int convert_buffer_size;
+    float *batch_buffer;
+    int batch_width;
+    int batch_height;
+    int batch_count;
+    int batch_index;
+
+    // application picture ring, the slots are stored in a refcounted
+    // buffer which frames referencing them keep alive
+    AVBufferRef *ring_state;
+    DE265RingSlot *ring;
+    int ring_count;
+    int ring_width;
+    int ring_height;
+    enum AVPixelFormat ring_format;
+    int ring_linesize[4];
+    int ring_slot_size;
+    LibDe265DecRingFrame ring_done[MAX_RING_SLOTS];
+    int ring_done_count;
+
+    // random access index
+    int build_index;
+    LibDe265DecIndexEntry *index;
+    unsigned int index_size;
+    int index_count;
+    // stream position of the next packet, used if packets have no position,
+    // -1 if unknown (after seeking)
+    int64_t index_stream_pos;
+    uint32_t index_param_set_crc[3];
 #if LIBDE265_NUMERIC_VERSION >= 0x00070000
-    int deblocking;
+    int disable_deblocking;
+    int disable_sao;
     int decode_ratio;
     int frame_queue_len;
     AVFrame *frame_queue[MAX_FRAME_QUEUE];
@@ -74,6 +272,14 @@ typedef struct DE265DecoderContext {
 } DE265Context;
 
 
+// Replacement for avcodec_set_dimensions, which newer libavcodec versions lack.
+static inline void set_dimensions(AVCodecContext *avctx, int width, int height) {
+    avctx->coded_width = width;
+    avctx->coded_height = height;
+    avctx->width = width;
+    avctx->height = height;
+}
+
 #if LIBDE265_NUMERIC_VERSION >= 0x00070000
 static inline int align_value(int value, int alignment) {
     return ((value + (alignment - 1)) & ~(alignment - 1));
@@ -226,6 +432,22 @@ static inline int get_output_bits_per_pixel(enum AVPixelFormat format) {
     }
 }
 
+// Pictures are only decoded into application buffers if they are returned
+// unconverted. The default get_buffer2 of libavcodec is skipped if the
+// pictures should be backed by huge pages.
+static inline int use_get_buffer2(AVCodecContext *avctx) {
+    DE265Context *ctx = (DE265Context *) avctx->priv_data;
+    if (avctx->get_buffer2 == NULL || ctx->output_format != OUTPUT_YUV) {
+        return 0;
+    }
+#if HAVE_HUGE_PAGES
+    if (ctx->huge_pages != HUGE_PAGES_OFF && avctx->get_buffer2 == avcodec_default_get_buffer2) {
+        return 0;
+    }
+#endif
+    return 1;
+}
+
 static void free_spec(DE265Context *ctx, struct de265_image_spec* spec) {
     if (ctx->spec_queue_len < MAX_SPEC_QUEUE) {
         ctx->spec_queue[ctx->spec_queue_len++] = spec;
@@ -234,6 +456,195 @@ static void free_spec(DE265Context *ctx, struct de265_image_spec* spec) {
     }
 }
 
+#if HAVE_HUGE_PAGES
+static void free_huge_page_buffer(void *opaque, uint8_t *data)
+{
+    munmap(data, (size_t) (uintptr_t) opaque);
+}
+
+/**
+ * Allocate all planes of a frame in one mapping backed by huge pages.
+ * The linesizes are a multiple of "alignment", so every plane honors it.
+ */
+static int alloc_huge_page_frame(AVFrame *frame, int alignment, int mode)
+{
+    enum AVPixelFormat format = (enum AVPixelFormat) frame->format;
+    int linesizes[4];
+    uint8_t *data[4];
+    int ret;
+
+    if ((ret = av_image_fill_linesizes(linesizes, format, frame->width)) < 0) {
+        return ret;
+    }
+    for (int i=0; i<4; i++) {
+        linesizes[i] = align_value(linesizes[i], alignment);
+    }
+    int size = av_image_fill_pointers(data, format, frame->height, NULL, linesizes);
+    if (size < 0) {
+        return size;
+    }
+
+    size_t mapping_size = align_value(size, HUGE_PAGE_SIZE);
+    uint8_t *ptr = (uint8_t *) MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (mode == HUGE_PAGES_EXPLICIT) {
+        ptr = (uint8_t *) mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (ptr == MAP_FAILED) {
+        // No (more) explicit huge pages available, map with some slack so
+        // the start can be aligned for transparent huge pages.
+        uint8_t *mapping = (uint8_t *) mmap(NULL, mapping_size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED) {
+            return AVERROR(ENOMEM);
+        }
+        ptr = (uint8_t *) (((uintptr_t) mapping + HUGE_PAGE_SIZE - 1) & ~((uintptr_t) HUGE_PAGE_SIZE - 1));
+        if (ptr != mapping) {
+            munmap(mapping, ptr - mapping);
+        }
+        munmap(ptr + mapping_size, HUGE_PAGE_SIZE - (ptr - mapping));
+#ifdef MADV_HUGEPAGE
+        madvise(ptr, mapping_size, MADV_HUGEPAGE);
+#endif
+    }
+
+    frame->buf[0] = av_buffer_create(ptr, size, free_huge_page_buffer, (void *) (uintptr_t) mapping_size, 0);
+    if (frame->buf[0] == NULL) {
+        munmap(ptr, mapping_size);
+        return AVERROR(ENOMEM);
+    }
+    av_image_fill_pointers(frame->data, format, frame->height, ptr, linesizes);
+    for (int i=0; i<4; i++) {
+        frame->linesize[i] = linesizes[i];
+    }
+    frame->extended_data = frame->data;
+    return 0;
+}
+#endif
+
+#if defined(__GNUC__)
+static inline int load_acquire(const int *ptr) {
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+static inline void store_release(int *ptr, int value) {
+    __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+}
+#else
+// MSVC gives volatile accesses acquire / release semantics
+static inline int load_acquire(const int *ptr) {
+    return *(const volatile int *) ptr;
+}
+
+static inline void store_release(int *ptr, int value) {
+    *(volatile int *) ptr = value;
+}
+#endif
+
+static DE265RingSlot *get_ring_slot(DE265Context *ctx, const AVFrame *frame) {
+    if (frame->buf[0] == NULL) {
+        return NULL;
+    }
+    for (int i=0; i<ctx->ring_count; i++) {
+        if (frame->buf[0]->data == ctx->ring[i].data) {
+            return &ctx->ring[i];
+        }
+    }
+    return NULL;
+}
+
+static void ff_libde265dec_ring_free(void *opaque, uint8_t *data)
+{
+    AVBufferRef *state = (AVBufferRef *) opaque;
+    DE265RingSlot *slots = (DE265RingSlot *) state->data;
+    for (int i=0; i<MAX_RING_SLOTS; i++) {
+        if (slots[i].data == data) {
+            store_release(&slots[i].decoding, 0);
+            break;
+        }
+    }
+    av_buffer_unref(&state);
+}
+
+/**
+ * Wrap a free slot of the application's ring in a frame. Returns NULL if
+ * no ring is set, the picture doesn't fit or all slots are in use.
+ */
+static AVFrame *ff_libde265dec_get_ring_frame(DE265Context *ctx, const struct de265_image_spec *spec, enum AVPixelFormat format)
+{
+    if (ctx->ring_count == 0 || ctx->output_format != OUTPUT_YUV || format != ctx->ring_format ||
+        spec->width > ctx->ring_width || spec->height > ctx->ring_height) {
+        return NULL;
+    }
+    for (int i=0; i<4; i++) {
+        if (ctx->ring_linesize[i] % spec->alignment) {
+            return NULL;
+        }
+    }
+
+    DE265RingSlot *slot = NULL;
+    for (int i=0; i<ctx->ring_count; i++) {
+        if (!load_acquire(&ctx->ring[i].decoding) && !ctx->ring[i].completed) {
+            slot = &ctx->ring[i];
+            break;
+        }
+    }
+    if (slot == NULL) {
+        return NULL;
+    }
+
+    AVFrame *frame = av_frame_alloc();
+    if (frame == NULL) {
+        return NULL;
+    }
+    AVBufferRef *state = av_buffer_ref(ctx->ring_state);
+    if (state == NULL) {
+        av_frame_free(&frame);
+        return NULL;
+    }
+    frame->buf[0] = av_buffer_create(slot->data, ctx->ring_slot_size, ff_libde265dec_ring_free, state, 0);
+    if (frame->buf[0] == NULL) {
+        av_buffer_unref(&state);
+        av_frame_free(&frame);
+        return NULL;
+    }
+    av_image_fill_pointers(frame->data, format, ctx->ring_height, slot->data, ctx->ring_linesize);
+    for (int i=0; i<4; i++) {
+        frame->linesize[i] = ctx->ring_linesize[i];
+    }
+    frame->extended_data = frame->data;
+    frame->width = spec->width;
+    frame->height = spec->height;
+    frame->format = format;
+
+    store_release(&slot->decoding, 1);
+    slot->width = spec->visible_width;
+    slot->height = spec->visible_height;
+    slot->crop_left = spec->crop_left;
+    slot->crop_top = spec->crop_top;
+    return frame;
+}
+
+// Queue the slot of an output frame for libde265dec_receive_ring_frames.
+static void ff_libde265dec_complete_ring_frame(DE265Context *ctx, const AVFrame *frame, int64_t pts)
+{
+    DE265RingSlot *slot = get_ring_slot(ctx, frame);
+    if (slot == NULL || slot->completed) {
+        return;
+    }
+
+    LibDe265DecRingFrame *done = &ctx->ring_done[ctx->ring_done_count++];
+    done->slot = slot - ctx->ring;
+    done->pts = pts;
+    done->width = slot->width;
+    done->height = slot->height;
+    done->crop_left = slot->crop_left;
+    done->crop_top = slot->crop_top;
+    slot->completed = 1;
+}
+
 static int ff_libde265dec_get_buffer(de265_decoder_context* ctx, struct de265_image_spec* spec, struct de265_image* img, void* userdata)
 {
     AVCodecContext *avctx = (AVCodecContext *) userdata;
@@ -258,8 +669,9 @@ static int ff_libde265dec_get_buffer(de265_decoder_context* ctx, struct de265_im
         goto fallback;
     }
 
-    AVFrame *frame = NULL;
-    if (avctx->get_buffer2) {
+    // decode directly into the application's ring if possible
+    AVFrame *frame = ff_libde265dec_get_ring_frame(dectx, spec, format);
+    if (frame == NULL && use_get_buffer2(avctx)) {
         frame = av_frame_alloc();
         if (frame == NULL) {
             goto fallback;
@@ -275,7 +687,7 @@ static int ff_libde265dec_get_buffer(de265_decoder_context* ctx, struct de265_im
             av_frame_free(&frame);
             goto fallback;
         }
-    } else {
+    } else if (frame == NULL) {
         if (dectx->frame_queue_len > 0) {
             frame = dectx->frame_queue[0];
             dectx->frame_queue_len--;
@@ -284,6 +696,10 @@ static int ff_libde265dec_get_buffer(de265_decoder_context* ctx, struct de265_im
             }
             if (frame->width != spec->width || frame->height != spec->height || frame->format != format) {
                 av_frame_free(&frame);
+            } else if (dectx->huge_pages != HUGE_PAGES_OFF && !av_frame_is_writable(frame)) {
+                // av_frame_make_writable would copy the picture to a heap
+                // buffer, map a new one instead
+                av_frame_free(&frame);
             } else {
                 av_frame_make_writable(frame);
             }
@@ -298,7 +714,13 @@ static int ff_libde265dec_get_buffer(de265_decoder_context* ctx, struct de265_im
             frame->width = spec->width;
             frame->height = spec->height;
             frame->format = format;
-            if (av_frame_get_buffer(frame, spec->alignment) != 0) {
+            int allocated = 0;
+#if HAVE_HUGE_PAGES
+            if (dectx->huge_pages != HUGE_PAGES_OFF) {
+                allocated = (alloc_huge_page_frame(frame, spec->alignment, dectx->huge_pages) == 0);
+            }
+#endif
+            if (!allocated && av_frame_get_buffer(frame, spec->alignment) != 0) {
                 av_frame_free(&frame);
                 goto fallback;
             }
@@ -356,7 +778,7 @@ static void ff_libde265dec_release_buffer(de265_decoder_context* ctx, struct de2
         free_spec(dectx, spec);
     }
 
-    if (avctx->get_buffer2) {
+    if (use_get_buffer2(avctx) || get_ring_slot(dectx, frame) != NULL) {
         av_frame_free(&frame);
         return;
     }
@@ -371,177 +793,2135 @@ static void ff_libde265dec_release_buffer(de265_decoder_context* ctx, struct de2
 #endif
 
 
-static int ff_libde265dec_decode(AVCodecContext *avctx,
-                                 void *data, int *got_frame, AVPacket *avpkt)
-{
-    DE265Context *ctx = (DE265Context *) avctx->priv_data;
-    AVFrame *picture = (AVFrame *) data;
-    const struct de265_image *img;
-    de265_error err;
-    int ret;
-    int64_t pts;
-    int more = 0;
+typedef struct DE265BitReader {
+    const uint8_t *data;
+    int size;   // in bits
+    int index;  // in bits
+} DE265BitReader;
+
+typedef struct DE265ShortTermRPS {
+    int num_negative;
+    int num_positive;
+    int delta_poc_s0[MAX_DELTA_POCS];
+    int delta_poc_s1[MAX_DELTA_POCS];
+} DE265ShortTermRPS;
+
+static const AVRational vui_sample_aspect_ratios[] = {
+    {  0,  1 }, {  1,  1 }, { 12, 11 }, { 10, 11 }, { 16, 11 }, { 40, 33 },
+    { 24, 11 }, { 20, 11 }, { 32, 11 }, { 80, 33 }, { 18, 11 }, { 15, 11 },
+    { 64, 33 }, {160, 99 }, {  4,  3 }, {  3,  2 }, {  2,  1 },
+};
+
+static inline void init_bit_reader(DE265BitReader *br, const uint8_t *data, int size) {
+    br->data = data;
+    br->size = size * 8;
+    br->index = 0;
+}
 
-    const uint8_t* src[4];
-    int stride[4];
+static inline int bits_overrun(const DE265BitReader *br) {
+    return br->index > br->size;
+}
 
-    if (ctx->check_extra) {
-        int extradata_size = avctx->extradata_size;
-        ctx->check_extra = 0;
-        if (extradata_size > 0) {
-            unsigned char *extradata = (unsigned char *) avctx->extradata;
-            if (extradata_size > 3 && extradata != NULL && (extradata[0] || extradata[1] || extradata[2] > 1)) {
-                ctx->packetized = 1;
-                if (extradata_size > 22) {
-                    if (extradata[0] != 0) {
-                        av_log(avctx, AV_LOG_WARNING, "Unsupported extra data version %d, decoding may fail\n", extradata[0]);
-                    }
-                    ctx->length_size = (extradata[21] & 3) + 1;
-                    int num_param_sets = extradata[22];
-                    int pos = 23;
-                    for (int i=0; i<num_param_sets; i++) {
-                        if (pos + 3 > extradata_size) {
-                            av_log(avctx, AV_LOG_ERROR, "Buffer underrun in extra header (%d >= %d)\n", pos + 3, extradata_size);
-                            return AVERROR_INVALIDDATA;
-                        }
-                        // ignore flags + NAL type (1 byte)
-                        int nal_count  = extradata[pos+1] << 8 | extradata[pos+2];
-                        pos += 3;
-                        for (int j=0; j<nal_count; j++) {
-                            if (pos + 2 > extradata_size) {
-                                av_log(avctx, AV_LOG_ERROR, "Buffer underrun in extra nal header (%d >= %d)\n", pos + 2, extradata_size);
-                                return AVERROR_INVALIDDATA;
-                            }
-                            int nal_size = extradata[pos] << 8 | extradata[pos+1];
-                            if (pos + 2 + nal_size > extradata_size) {
-                                av_log(avctx, AV_LOG_ERROR, "Buffer underrun in extra nal (%d >= %d)\n", pos + 2 + nal_size, extradata_size);
-                                return AVERROR_INVALIDDATA;
-                            }
-                            err = de265_push_NAL(ctx->decoder, extradata + pos + 2, nal_size, 0, NULL);
-                            if (!de265_isOK(err)) {
-                                av_log(avctx, AV_LOG_ERROR, "Failed to push data: %s (%d)\n", de265_get_error_text(err), err);
-                                return AVERROR_INVALIDDATA;
-                            }
-                            pos += 2 + nal_size;
-                        }
-                    }
-                }
-                av_log(avctx, AV_LOG_DEBUG, "Assuming packetized data (%d bytes length)\n", ctx->length_size);
-            } else {
-                ctx->packetized = 0;
-                av_log(avctx, AV_LOG_DEBUG, "Assuming non-packetized data\n");
-                err = de265_push_data(ctx->decoder, extradata, extradata_size, 0, NULL);
-                if (!de265_isOK(err)) {
-                    av_log(avctx, AV_LOG_ERROR, "Failed to push extra data: %s (%d)\n", de265_get_error_text(err), err);
-                    return AVERROR_INVALIDDATA;
-                }
-            }
-#if LIBDE265_NUMERIC_VERSION >= 0x00070000
-            de265_push_end_of_NAL(ctx->decoder);
-#endif
-            do {
-                err = de265_decode(ctx->decoder, &more);
-                switch (err) {
-                case DE265_OK:
-                    break;
+static inline void skip_bits(DE265BitReader *br, int n) {
+    br->index += n;
+}
 
-                case DE265_ERROR_IMAGE_BUFFER_FULL:
-                case DE265_ERROR_WAITING_FOR_INPUT_DATA:
-                    // not really an error
-                    more = 0;
-                    break;
+static inline unsigned int read_bits(DE265BitReader *br, int n) {
+    unsigned int value = 0;
+    for (int i=0; i<n; i++) {
+        int bit = 0;
+        if (br->index < br->size) {
+            bit = (br->data[br->index >> 3] >> (7 - (br->index & 7))) & 1;
+        }
+        value = (value << 1) | bit;
+        br->index++;
+    }
+    return value;
+}
 
-                default:
-                    if (!de265_isOK(err)) {
-                        av_log(avctx, AV_LOG_ERROR, "Failed to decode extra data: %s (%d)\n", de265_get_error_text(err), err);
-                        return AVERROR_INVALIDDATA;
-                    }
-                }
-            } while (more);
+static inline unsigned int read_ue(DE265BitReader *br) {
+    int zeros = 0;
+    while (!read_bits(br, 1)) {
+        if (++zeros > 31 || bits_overrun(br)) {
+            br->index = br->size + 1;
+            return 0;
         }
     }
+    if (zeros == 0) {
+        return 0;
+    }
+    return ((1U << zeros) - 1) + read_bits(br, zeros);
+}
 
-    if (avpkt->size > 0) {
-        if (avpkt->pts != AV_NOPTS_VALUE) {
-            pts = avpkt->pts;
-        } else {
-            pts = avctx->reordered_opaque;
+static inline int read_se(DE265BitReader *br) {
+    unsigned int value = read_ue(br);
+    return (value & 1) ? (int) ((value >> 1) + 1) : -(int) (value >> 1);
+}
+
+static inline int is_irap(int nal_unit_type) {
+    return nal_unit_type >= NAL_UNIT_BLA_W_LP && nal_unit_type <= NAL_UNIT_RSV_IRAP_23;
+}
+
+static inline int is_sub_layer_non_reference(int nal_unit_type) {
+    return nal_unit_type < NAL_UNIT_BLA_W_LP && (nal_unit_type & 1) == 0;
+}
+
+// Check if the discard level depends on the pictures in a packet.
+static inline int needs_picture_info(int level) {
+    return level > AVDISCARD_DEFAULT && level < AVDISCARD_ALL;
+}
+
+/**
+ * Check if the first picture started in the access unit would be
+ * discarded with the given AVDiscard level.
+ */
+static int discard_picture(const DE265AccessUnit *au, int level)
+{
+    if (level <= AVDISCARD_DEFAULT) {
+        return 0;
+    } else if (level >= AVDISCARD_ALL) {
+        return 1;
+    }
+
+    return (level >= AVDISCARD_NONKEY && !is_irap(au->nal_unit_type)) ||
+           (level >= AVDISCARD_NONINTRA && au->slice_type != 2) ||
+           (level >= AVDISCARD_BIDIR && au->slice_type == 0) ||
+           (level >= AVDISCARD_NONREF && is_sub_layer_non_reference(au->nal_unit_type));
+}
+
+/**
+ * Copy the payload of a NAL unit (without the two byte header) to the
+ * RBSP buffer, removing emulation prevention bytes.
+ */
+static int ff_libde265dec_unescape_rbsp(DE265Context *ctx, const uint8_t *data, int size)
+{
+    av_fast_malloc(&ctx->rbsp_buffer, &ctx->rbsp_buffer_size, size);
+    if (ctx->rbsp_buffer == NULL) {
+        return AVERROR(ENOMEM);
+    }
+
+    int len = 0;
+    int zeros = 0;
+    for (int i=0; i<size; i++) {
+        if (zeros >= 2 && data[i] == 3) {
+            zeros = 0;
+            continue;
         }
+        ctx->rbsp_buffer[len++] = data[i];
+        zeros = data[i] ? 0 : zeros + 1;
+    }
+    return len;
+}
 
-        if (ctx->packetized) {
-            uint8_t* avpkt_data = avpkt->data;
-            uint8_t* avpkt_end = avpkt->data + avpkt->size;
-            while (avpkt_data + ctx->length_size <= avpkt_end) {
-                int nal_size = 0;
-                int i;
-                for (i=0; i<ctx->length_size; i++) {
-                    nal_size = (nal_size << 8) | avpkt_data[i];
+static void skip_scaling_list_data(DE265BitReader *br)
+{
+    for (int size_id=0; size_id<4; size_id++) {
+        for (int matrix_id=0; matrix_id<6; matrix_id += (size_id == 3) ? 3 : 1) {
+            if (!read_bits(br, 1)) {
+                // scaling_list_pred_matrix_id_delta
+                read_ue(br);
+            } else {
+                int coef_num = LIBDE265_FFMPEG_MIN(64, 1 << (4 + (size_id << 1)));
+                if (size_id > 1) {
+                    // scaling_list_dc_coef_minus8
+                    read_se(br);
                 }
-                err = de265_push_NAL(ctx->decoder, avpkt_data + ctx->length_size, nal_size, pts, NULL);
-                if (err != DE265_OK) {
-                    const char *error = de265_get_error_text(err);
-                    av_log(avctx, AV_LOG_ERROR, "Failed to push data: %s\n", error);
-                    return AVERROR_INVALIDDATA;
+                for (int i=0; i<coef_num; i++) {
+                    read_se(br);
                 }
-                avpkt_data += ctx->length_size + nal_size;
-            }
-        } else {
-            err = de265_push_data(ctx->decoder, avpkt->data, avpkt->size, pts, NULL);
-            if (err != DE265_OK) {
-                const char *error = de265_get_error_text(err);
-                av_log(avctx, AV_LOG_ERROR, "Failed to push data: %s\n", error);
-                return AVERROR_INVALIDDATA;
             }
         }
-    } else {
-        de265_flush_data(ctx->decoder);
     }
+}
 
-#if LIBDE265_NUMERIC_VERSION >= 0x00070000
-    // TODO: libde265 should support more fine-grained settings
-    int deblocking = (avctx->skip_loop_filter < AVDISCARD_NONREF);
-    if (deblocking != ctx->deblocking) {
-        ctx->deblocking = deblocking;
-        de265_set_parameter_bool(ctx->decoder, DE265_DECODER_PARAM_DISABLE_DEBLOCKING, deblocking);
-        // TODO: how to notify to disable SAO?
-        de265_set_parameter_bool(ctx->decoder, DE265_DECODER_PARAM_DISABLE_SAO, deblocking);
-    }
-    int decode_ratio = (avctx->skip_frame < AVDISCARD_NONREF) ? 100 : 0;
-    if (decode_ratio != ctx->decode_ratio) {
-        ctx->decode_ratio = decode_ratio;
-        de265_set_framerate_ratio(ctx->decoder, decode_ratio);
-    }
-#endif
+static int parse_short_term_rps(DE265BitReader *br, DE265ShortTermRPS *sets, int idx)
+{
+    DE265ShortTermRPS *rps = &sets[idx];
+    if (idx != 0 && read_bits(br, 1)) {
+        // inter_ref_pic_set_prediction_flag, predict from previous set
+        const DE265ShortTermRPS *ref = &sets[idx - 1];
+        int sign = read_bits(br, 1);
+        int delta_rps = (int) (read_ue(br) + 1) * (sign ? -1 : 1);
+        int num_delta_pocs = ref->num_negative + ref->num_positive;
+        int use_delta[2 * MAX_DELTA_POCS + 1];
+        for (int j=0; j<=num_delta_pocs; j++) {
+            int used = read_bits(br, 1);
+            use_delta[j] = used ? 1 : read_bits(br, 1);
+        }
 
-    // decode as much as possible up to next image
-    do {
-        more = 0;
-        err = de265_decode(ctx->decoder, &more);
-        if (err != DE265_OK) {
-            break;
+        int i = 0;
+        for (int j=ref->num_positive-1; j>=0; j--) {
+            int poc = ref->delta_poc_s1[j] + delta_rps;
+            if (poc < 0 && use_delta[ref->num_negative + j] && i < MAX_DELTA_POCS) {
+                rps->delta_poc_s0[i++] = poc;
+            }
         }
-        if (de265_peek_next_picture(ctx->decoder) != NULL) {
-            break;
+        if (delta_rps < 0 && use_delta[num_delta_pocs] && i < MAX_DELTA_POCS) {
+            rps->delta_poc_s0[i++] = delta_rps;
         }
-    } while (more && err == DE265_OK);
-
-    switch (err) {
-    case DE265_OK:
-    case DE265_ERROR_IMAGE_BUFFER_FULL:
-    case DE265_ERROR_WAITING_FOR_INPUT_DATA:
-        break;
-
-    default:
-        {
-            const char *error  = de265_get_error_text(err);
+        for (int j=0; j<ref->num_negative; j++) {
+            int poc = ref->delta_poc_s0[j] + delta_rps;
+            if (poc < 0 && use_delta[j] && i < MAX_DELTA_POCS) {
+                rps->delta_poc_s0[i++] = poc;
+            }
+        }
+        rps->num_negative = i;
 
-            av_log(avctx, AV_LOG_ERROR, "Failed to decode frame: %s\n", error);
+        i = 0;
+        for (int j=ref->num_negative-1; j>=0; j--) {
+            int poc = ref->delta_poc_s0[j] + delta_rps;
+            if (poc > 0 && use_delta[j] && i < MAX_DELTA_POCS) {
+                rps->delta_poc_s1[i++] = poc;
+            }
+        }
+        if (delta_rps > 0 && use_delta[num_delta_pocs] && i < MAX_DELTA_POCS) {
+            rps->delta_poc_s1[i++] = delta_rps;
+        }
+        for (int j=0; j<ref->num_positive; j++) {
+            int poc = ref->delta_poc_s1[j] + delta_rps;
+            if (poc > 0 && use_delta[ref->num_negative + j] && i < MAX_DELTA_POCS) {
+                rps->delta_poc_s1[i++] = poc;
+            }
+        }
+        rps->num_positive = i;
+    } else {
+        unsigned int num_negative = read_ue(br);
+        unsigned int num_positive = read_ue(br);
+        if (num_negative > MAX_DELTA_POCS || num_positive > MAX_DELTA_POCS ||
+            num_negative + num_positive > MAX_DELTA_POCS) {
             return AVERROR_INVALIDDATA;
         }
-    }
 
-    if ((img = de265_get_next_picture(ctx->decoder)) != NULL) {
-        int width;
+        int poc = 0;
+        for (unsigned int i=0; i<num_negative; i++) {
+            poc -= read_ue(br) + 1;
+            rps->delta_poc_s0[i] = poc;
+            // used_by_curr_pic_s0_flag
+            skip_bits(br, 1);
+        }
+        poc = 0;
+        for (unsigned int i=0; i<num_positive; i++) {
+            poc += read_ue(br) + 1;
+            rps->delta_poc_s1[i] = poc;
+            // used_by_curr_pic_s1_flag
+            skip_bits(br, 1);
+        }
+        rps->num_negative = num_negative;
+        rps->num_positive = num_positive;
+    }
+    return bits_overrun(br) ? AVERROR_INVALIDDATA : 0;
+}
+
+static int ff_libde265dec_parse_sps(AVCodecContext *avctx, const uint8_t *data, int size)
+{
+    DE265Context *ctx = (DE265Context *) avctx->priv_data;
+    DE265BitReader br;
+    int len = ff_libde265dec_unescape_rbsp(ctx, data, size);
+    if (len < 0) {
+        return len;
+    }
+    init_bit_reader(&br, ctx->rbsp_buffer, len);
+
+    // sps_video_parameter_set_id
+    skip_bits(&br, 4);
+    int max_sub_layers = read_bits(&br, 3) + 1;
+    // sps_temporal_id_nesting_flag
+    skip_bits(&br, 1);
+
+    // profile_tier_level: profile space, tier and profile
+    skip_bits(&br, 3);
+    int profile = read_bits(&br, 5);
+    // compatibility flags, source flags and constraint flags
+    skip_bits(&br, 32 + 4 + 44);
+    int level = read_bits(&br, 8);
+    int sub_layer_profile_present[8];
+    int sub_layer_level_present[8];
+    for (int i=0; i<max_sub_layers-1; i++) {
+        sub_layer_profile_present[i] = read_bits(&br, 1);
+        sub_layer_level_present[i] = read_bits(&br, 1);
+    }
+    if (max_sub_layers > 1) {
+        skip_bits(&br, 2 * (8 - (max_sub_layers - 1)));
+    }
+    for (int i=0; i<max_sub_layers-1; i++) {
+        if (sub_layer_profile_present[i]) {
+            skip_bits(&br, 88);
+        }
+        if (sub_layer_level_present[i]) {
+            skip_bits(&br, 8);
+        }
+    }
+
+    // sps_seq_parameter_set_id
+    read_ue(&br);
+    unsigned int chroma_format_idc = read_ue(&br);
+    if (chroma_format_idc > 3) {
+        return AVERROR_INVALIDDATA;
+    }
+    if (chroma_format_idc == 3) {
+        // separate_colour_plane_flag
+        skip_bits(&br, 1);
+    }
+    unsigned int width = read_ue(&br);
+    unsigned int height = read_ue(&br);
+    unsigned int crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+    if (read_bits(&br, 1)) {
+        int sub_width = (chroma_format_idc == 1 || chroma_format_idc == 2) ? 2 : 1;
+        int sub_height = (chroma_format_idc == 1) ? 2 : 1;
+        crop_left = read_ue(&br) * sub_width;
+        crop_right = read_ue(&br) * sub_width;
+        crop_top = read_ue(&br) * sub_height;
+        crop_bottom = read_ue(&br) * sub_height;
+    }
+    unsigned int bit_depth_luma = read_ue(&br) + 8;
+    unsigned int bit_depth_chroma = read_ue(&br) + 8;
+    unsigned int log2_max_poc_lsb = read_ue(&br) + 4;
+    if (bits_overrun(&br) || log2_max_poc_lsb > 16 ||
+        crop_left + crop_right >= width || crop_top + crop_bottom >= height) {
+        return AVERROR_INVALIDDATA;
+    }
+
+    int ordering_info_present = read_bits(&br, 1);
+    for (int i=(ordering_info_present ? 0 : max_sub_layers - 1); i<max_sub_layers; i++) {
+        // max_dec_pic_buffering, max_num_reorder_pics, max_latency_increase
+        read_ue(&br);
+        read_ue(&br);
+        read_ue(&br);
+    }
+    // coding block and transform block sizes and depths
+    for (int i=0; i<6; i++) {
+        read_ue(&br);
+    }
+    if (read_bits(&br, 1) && read_bits(&br, 1)) {
+        skip_scaling_list_data(&br);
+    }
+    // amp_enabled_flag, sample_adaptive_offset_enabled_flag
+    skip_bits(&br, 2);
+    if (read_bits(&br, 1)) {
+        // PCM sample bit depths, coding block sizes and loop filter flag
+        skip_bits(&br, 8);
+        read_ue(&br);
+        read_ue(&br);
+        skip_bits(&br, 1);
+    }
+    unsigned int num_short_term_rps = read_ue(&br);
+    if (num_short_term_rps > MAX_SHORT_TERM_RPS) {
+        return AVERROR_INVALIDDATA;
+    }
+    DE265ShortTermRPS short_term_rps[MAX_SHORT_TERM_RPS];
+    for (unsigned int i=0; i<num_short_term_rps; i++) {
+        if (parse_short_term_rps(&br, short_term_rps, i) < 0) {
+            return AVERROR_INVALIDDATA;
+        }
+    }
+    if (read_bits(&br, 1)) {
+        unsigned int num_long_term_ref_pics = read_ue(&br);
+        if (num_long_term_ref_pics > 32) {
+            return AVERROR_INVALIDDATA;
+        }
+        skip_bits(&br, num_long_term_ref_pics * (log2_max_poc_lsb + 1));
+    }
+    // sps_temporal_mvp_enabled_flag, strong_intra_smoothing_enabled_flag
+    skip_bits(&br, 2);
+    if (bits_overrun(&br)) {
+        return AVERROR_INVALIDDATA;
+    }
+
+    int visible_width = width - crop_left - crop_right;
+    int visible_height = height - crop_top - crop_bottom;
+    if (av_image_check_size(visible_width, visible_height, 0, avctx) < 0) {
+        return AVERROR_INVALIDDATA;
+    }
+    if (visible_width != avctx->width || visible_height != avctx->height) {
+        set_dimensions(avctx, visible_width, visible_height);
+    }
+    avctx->coded_width = width;
+    avctx->coded_height = height;
+    avctx->pix_fmt = get_pixel_format(avctx, (enum de265_chroma) chroma_format_idc,
+                                      LIBDE265_FFMPEG_MAX(bit_depth_luma, chroma_format_idc ? bit_depth_chroma : 0));
+    avctx->bits_per_raw_sample = bit_depth_luma;
+    avctx->profile = profile;
+    avctx->level = level;
+
+    if (!read_bits(&br, 1)) {
+        return 0;
+    }
+
+    // VUI, parsing stops after the timing information
+    AVRational sample_aspect_ratio = { 0, 1 };
+    if (read_bits(&br, 1)) {
+        unsigned int aspect_ratio_idc = read_bits(&br, 8);
+        if (aspect_ratio_idc < FF_ARRAY_ELEMS(vui_sample_aspect_ratios)) {
+            sample_aspect_ratio = vui_sample_aspect_ratios[aspect_ratio_idc];
+        } else if (aspect_ratio_idc == 255) {
+            sample_aspect_ratio.num = read_bits(&br, 16);
+            sample_aspect_ratio.den = read_bits(&br, 16);
+        }
+    }
+    if (read_bits(&br, 1)) {
+        // overscan_appropriate_flag
+        skip_bits(&br, 1);
+    }
+    int full_range = 0;
+    int colour_description_present = 0;
+    int colour_primaries = 0, transfer_characteristics = 0, matrix_coeffs = 0;
+    if (read_bits(&br, 1)) {
+        // video_format
+        skip_bits(&br, 3);
+        full_range = read_bits(&br, 1);
+        colour_description_present = read_bits(&br, 1);
+        if (colour_description_present) {
+            colour_primaries = read_bits(&br, 8);
+            transfer_characteristics = read_bits(&br, 8);
+            matrix_coeffs = read_bits(&br, 8);
+        }
+    }
+    int chroma_loc_info_present = read_bits(&br, 1);
+    unsigned int chroma_sample_loc_type = 0;
+    if (chroma_loc_info_present) {
+        chroma_sample_loc_type = read_ue(&br);
+        // chroma_sample_loc_type_bottom_field
+        read_ue(&br);
+    }
+    // neutral_chroma_indication_flag, field_seq_flag, frame_field_info_present_flag
+    skip_bits(&br, 3);
+    if (read_bits(&br, 1)) {
+        // default display window
+        for (int i=0; i<4; i++) {
+            read_ue(&br);
+        }
+    }
+    int timing_info_present = read_bits(&br, 1);
+    unsigned int num_units_in_tick = 0, time_scale = 0;
+    if (timing_info_present) {
+        num_units_in_tick = read_bits(&br, 32);
+        time_scale = read_bits(&br, 32);
+    }
+    if (bits_overrun(&br)) {
+        av_log(avctx, AV_LOG_WARNING, "Truncated VUI parameters, ignoring\n");
+        return 0;
+    }
+
+    avctx->sample_aspect_ratio = sample_aspect_ratio;
+    avctx->color_range = full_range ? AVCOL_RANGE_JPEG : AVCOL_RANGE_MPEG;
+    if (colour_description_present) {
+        avctx->color_primaries = (enum AVColorPrimaries) colour_primaries;
+        avctx->color_trc = (enum AVColorTransferCharacteristic) transfer_characteristics;
+        avctx->colorspace = (enum AVColorSpace) matrix_coeffs;
+    }
+    if (chroma_loc_info_present && chroma_sample_loc_type < 6) {
+        avctx->chroma_sample_location = (enum AVChromaLocation) (chroma_sample_loc_type + 1);
+    }
+    if (timing_info_present && num_units_in_tick > 0 && time_scale > 0) {
+        av_reduce(&avctx->time_base.num, &avctx->time_base.den,
+                  num_units_in_tick, time_scale, 1 << 30);
+    }
+    return 0;
+}
+
+static int ff_libde265dec_parse_pps(AVCodecContext *avctx, const uint8_t *data, int size)
+{
+    DE265Context *ctx = (DE265Context *) avctx->priv_data;
+    DE265BitReader br;
+    int len = ff_libde265dec_unescape_rbsp(ctx, data, LIBDE265_FFMPEG_MIN(size, MAX_SLICE_HEADER_SIZE));
+    if (len < 0) {
+        return len;
+    }
+    init_bit_reader(&br, ctx->rbsp_buffer, len);
+
+    unsigned int pps_id = read_ue(&br);
+    // pps_seq_parameter_set_id
+    read_ue(&br);
+    // dependent_slice_segments_enabled_flag, output_flag_present_flag
+    skip_bits(&br, 2);
+    int num_extra_slice_header_bits = read_bits(&br, 3);
+    if (bits_overrun(&br) || pps_id >= MAX_PPS_COUNT) {
+        return AVERROR_INVALIDDATA;
+    }
+    ctx->pps_extra_slice_header_bits[pps_id] = num_extra_slice_header_bits;
+    return 0;
+}
+
+static int ff_libde265dec_parse_slice_header(AVCodecContext *avctx, int nal_unit_type, const uint8_t *data, int size)
+{
+    DE265Context *ctx = (DE265Context *) avctx->priv_data;
+    DE265BitReader br;
+    int len = ff_libde265dec_unescape_rbsp(ctx, data, LIBDE265_FFMPEG_MIN(size, MAX_SLICE_HEADER_SIZE));
+    if (len < 0) {
+        return len;
+    }
+    init_bit_reader(&br, ctx->rbsp_buffer, len);
+
+    if (!read_bits(&br, 1)) {
+        // not the first slice segment of a picture
+        return 0;
+    }
+    if (is_irap(nal_unit_type)) {
+        // no_output_of_prior_pics_flag
+        skip_bits(&br, 1);
+    }
+    unsigned int pps_id = read_ue(&br);
+    if (pps_id >= MAX_PPS_COUNT) {
+        return AVERROR_INVALIDDATA;
+    }
+    skip_bits(&br, ctx->pps_extra_slice_header_bits[pps_id]);
+    unsigned int slice_type = read_ue(&br);
+    if (bits_overrun(&br) || slice_type > 2) {
+        return AVERROR_INVALIDDATA;
+    }
+
+    if (ctx->au.pictures++ == 0) {
+        ctx->au.nal_unit_type = nal_unit_type;
+        ctx->au.slice_type = slice_type;
+    }
+    return 0;
+}
+
+static int ff_libde265dec_parse_sei(AVCodecContext *avctx, const uint8_t *data, int size)
+{
+    DE265Context *ctx = (DE265Context *) avctx->priv_data;
+    int len = ff_libde265dec_unescape_rbsp(ctx, data, size);
+    if (len < 0) {
+        return len;
+    }
+
+    const uint8_t *ptr = ctx->rbsp_buffer;
+    const uint8_t *end = ctx->rbsp_buffer + len;
+    // the last byte contains the rbsp trailing bits
+    while (end - ptr > 1) {
+        int payload_type = 0;
+        int payload_size = 0;
+        while (ptr < end && *ptr == 0xff) {
+            payload_type += 255;
+            ptr++;
+        }
+        if (ptr == end) {
+            return AVERROR_INVALIDDATA;
+        }
+        payload_type += *ptr++;
+        while (ptr < end && *ptr == 0xff) {
+            payload_size += 255;
+            ptr++;
+        }
+        if (ptr == end) {
+            return AVERROR_INVALIDDATA;
+        }
+        payload_size += *ptr++;
+        if (payload_size > end - ptr) {
+            return AVERROR_INVALIDDATA;
+        }
+
+        DE265BitReader br;
+        init_bit_reader(&br, ptr, payload_size);
+        switch (payload_type) {
+        case SEI_MASTERING_DISPLAY_COLOUR_VOLUME:
+            for (int i=0; i<3; i++) {
+                ctx->mastering_primaries[i][0] = read_bits(&br, 16);
+                ctx->mastering_primaries[i][1] = read_bits(&br, 16);
+            }
+            ctx->mastering_white_point[0] = read_bits(&br, 16);
+            ctx->mastering_white_point[1] = read_bits(&br, 16);
+            ctx->mastering_max_luminance = read_bits(&br, 32);
+            ctx->mastering_min_luminance = read_bits(&br, 32);
+            ctx->mastering_present = !bits_overrun(&br);
+            break;
+
+        case SEI_CONTENT_LIGHT_LEVEL_INFO:
+            ctx->max_content_light_level = read_bits(&br, 16);
+            ctx->max_pic_average_light_level = read_bits(&br, 16);
+            ctx->light_level_present = !bits_overrun(&br);
+            break;
+
+        case SEI_TIME_CODE:
+            {
+                // only the first clock timestamp is exported
+                int num_clock_ts = read_bits(&br, 2);
+                if (num_clock_ts == 0 || !read_bits(&br, 1)) {
+                    break;
+                }
+                // units_field_based_flag, counting_type
+                skip_bits(&br, 6);
+                int full_timestamp = read_bits(&br, 1);
+                // discontinuity_flag
+                skip_bits(&br, 1);
+                int drop_frame = read_bits(&br, 1);
+                int frames = read_bits(&br, 9);
+                int seconds = 0, minutes = 0, hours = 0;
+                if (full_timestamp) {
+                    seconds = read_bits(&br, 6);
+                    minutes = read_bits(&br, 6);
+                    hours = read_bits(&br, 5);
+                } else if (read_bits(&br, 1)) {
+                    seconds = read_bits(&br, 6);
+                    if (read_bits(&br, 1)) {
+                        minutes = read_bits(&br, 6);
+                        if (read_bits(&br, 1)) {
+                            hours = read_bits(&br, 5);
+                        }
+                    }
+                }
+                if (!bits_overrun(&br)) {
+                    snprintf(ctx->timecode, sizeof(ctx->timecode), "%02d:%02d:%02d%c%02d",
+                             hours, minutes, seconds, drop_frame ? ';' : ':', frames);
+                }
+            }
+            break;
+
+        default:
+            break;
+        }
+        ptr += payload_size;
+    }
+    return 0;
+}
+
+/**
+ * Parse a NAL unit (starting with the NAL unit header) without passing
+ * it to libde265. Invalid NAL units are reported and skipped.
+ */
+static int ff_libde265dec_parse_nal(AVCodecContext *avctx, const uint8_t *data, int size)
+{
+    if (size < 3) {
+        return 0;
+    }
+
+    int nal_unit_type = (data[0] >> 1) & 0x3f;
+    int nuh_layer_id = ((data[0] & 1) << 5) | (data[1] >> 3);
+    if (nuh_layer_id > 0) {
+        // only the base layer is handled
+        return 0;
+    }
+
+    DE265Context *ctx = (DE265Context *) avctx->priv_data;
+    if (ctx->build_index && nal_unit_type >= NAL_UNIT_VPS && nal_unit_type <= NAL_UNIT_PPS) {
+        int idx = nal_unit_type - NAL_UNIT_VPS;
+        ctx->au.param_sets |= 1 << idx;
+        ctx->au.param_set_crc[idx] = av_crc(av_crc_get_table(AV_CRC_32_IEEE), ctx->au.param_set_crc[idx], data, size);
+    }
+
+    // When decoding, the stream information and SEI come from libde265,
+    // only the types of the pictures are needed.
+    int ret;
+    switch (nal_unit_type) {
+    case NAL_UNIT_SPS:
+        // the colour description is needed for the RGB conversion
+        ret = (ctx->probe || ctx->output_format != OUTPUT_YUV) ? ff_libde265dec_parse_sps(avctx, data + 2, size - 2) : 0;
+        break;
+    case NAL_UNIT_PPS:
+        ret = ff_libde265dec_parse_pps(avctx, data + 2, size - 2);
+        break;
+    case NAL_UNIT_PREFIX_SEI:
+        ret = ctx->probe ? ff_libde265dec_parse_sei(avctx, data + 2, size - 2) : 0;
+        break;
+    default:
+        if (nal_unit_type < NAL_UNIT_VPS) {
+            ret = ff_libde265dec_parse_slice_header(avctx, nal_unit_type, data + 2, size - 2);
+        } else {
+            ret = 0;
+        }
+        break;
+    }
+
+    if (ret == AVERROR_INVALIDDATA) {
+        av_log(avctx, AV_LOG_WARNING, "Failed to parse NAL unit of type %d\n", nal_unit_type);
+        ret = 0;
+    }
+    return ret;
+}
+
+/**
+ * Return a pointer to the next 0x000001 start code or to "end" if there
+ * is no further start code.
+ */
+static const uint8_t *find_start_code_c(const uint8_t *ptr, const uint8_t *end)
+{
+    while (end - ptr > 2) {
+        if (ptr[2] > 1) {
+            ptr += 3;
+        } else if (ptr[2] == 1 && ptr[1] == 0 && ptr[0] == 0) {
+            return ptr;
+        } else {
+            ptr++;
+        }
+    }
+    return end;
+}
+
+// The vectorized versions compare 16 / 32 positions at once against the
+// three bytes of the start code and finish the tail with the C version.
+#if HAVE_SSE2_INTRINSICS
+static const uint8_t *find_start_code_sse2(const uint8_t *ptr, const uint8_t *end)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    while (end - ptr >= 18) {
+        __m128i b0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) ptr), zero);
+        __m128i b1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (ptr + 1)), zero);
+        __m128i b2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (ptr + 2)), one);
+        int mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(b0, b1), b2));
+        if (mask) {
+            return ptr + __builtin_ctz(mask);
+        }
+        ptr += 16;
+    }
+    return find_start_code_c(ptr, end);
+}
+#endif
+
+#if HAVE_AVX2_INTRINSICS
+__attribute__((target("avx2")))
+static const uint8_t *find_start_code_avx2(const uint8_t *ptr, const uint8_t *end)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    while (end - ptr >= 34) {
+        __m256i b0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) ptr), zero);
+        __m256i b1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (ptr + 1)), zero);
+        __m256i b2 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (ptr + 2)), one);
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(b0, b1), b2));
+        if (mask) {
+            return ptr + __builtin_ctz(mask);
+        }
+        ptr += 32;
+    }
+    return find_start_code_sse2(ptr, end);
+}
+#endif
+
+#if HAVE_NEON_INTRINSICS
+static const uint8_t *find_start_code_neon(const uint8_t *ptr, const uint8_t *end)
+{
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t one = vdupq_n_u8(1);
+    while (end - ptr >= 18) {
+        uint8x16_t b0 = vceqq_u8(vld1q_u8(ptr), zero);
+        uint8x16_t b1 = vceqq_u8(vld1q_u8(ptr + 1), zero);
+        uint8x16_t b2 = vceqq_u8(vld1q_u8(ptr + 2), one);
+        if (vmaxvq_u8(vandq_u8(vandq_u8(b0, b1), b2))) {
+            // there is no movemask, the C version finds the exact position
+            return find_start_code_c(ptr, ptr + 18);
+        }
+        ptr += 16;
+    }
+    return find_start_code_c(ptr, end);
+}
+#endif
+
+#if HAVE_AVX2_INTRINSICS
+static const uint8_t *(*find_start_code)(const uint8_t *ptr, const uint8_t *end) = find_start_code_sse2;
+#elif HAVE_SSE2_INTRINSICS
+#define find_start_code find_start_code_sse2
+#elif HAVE_NEON_INTRINSICS
+#define find_start_code find_start_code_neon
+#else
+#define find_start_code find_start_code_c
+#endif
+
+/**
+ * Pass a NAL unit from Annex-B data to libde265 (unless probing),
+ * optionally parsing it first.
+ */
+static int ff_libde265dec_push_annexb_nal(AVCodecContext *avctx, const uint8_t *nal, const uint8_t *nal_end,
+                                          int64_t pts, int inspect)
+{
+    DE265Context *ctx = (DE265Context *) avctx->priv_data;
+    // strip trailing zero bytes and the leading zero of 4 byte start codes
+    while (nal_end > nal && nal_end[-1] == 0) {
+        nal_end--;
+    }
+    if (nal_end == nal) {
+        return 0;
+    }
+
+    if (inspect) {
+        int ret = ff_libde265dec_parse_nal(avctx, nal, nal_end - nal);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    if (!ctx->probe) {
+        de265_error err = de265_push_NAL(ctx->decoder, nal, nal_end - nal, pts, NULL);
+        if (err != DE265_OK) {
+            const char *error = de265_get_error_text(err);
+            av_log(avctx, AV_LOG_ERROR, "Failed to push data: %s\n", error);
+            return AVERROR_INVALIDDATA;
+        }
+    }
+    return 0;
+}
+
+// Pass the NAL unit carried over from the previous packet to libde265.
+static int ff_libde265dec_flush_annexb(AVCodecContext *avctx)
+{
+    DE265Context *ctx = (DE265Context *) avctx->priv_data;
+    if (!ctx->nal_pending) {
+        return 0;
+    }
+
+    ctx->nal_pending = 0;
+    // the NAL unit was parsed together with the packet it started in
+    return ff_libde265dec_push_annexb_nal(avctx, ctx->nal_buffer, ctx->nal_buffer + ctx->nal_buffer_len,
+                                          ctx->nal_pts, 0);
+}
+
+static int append_pending_nal(DE265Context *ctx, const uint8_t *data, int size)
+{
+    if (size == 0) {
+        return 0;
+    }
+    if (size > INT_MAX - ctx->nal_buffer_len) {
+        return AVERROR(ENOMEM);
+    }
+    uint8_t *buffer = (uint8_t *) av_fast_realloc(ctx->nal_buffer, &ctx->nal_buffer_size, ctx->nal_buffer_len + size);
+    if (buffer == NULL) {
+        return AVERROR(ENOMEM);
+    }
+    ctx->nal_buffer = buffer;
+    memcpy(buffer + ctx->nal_buffer_len, data, size);
+    ctx->nal_buffer_len += size;
+    return 0;
+}
+
+/**
+ * Split Annex-B data into NAL units and pass them to libde265 (unless
+ * probing), optionally parsing them first.
+ *
+ * The end of the last NAL unit is only known with the next start code,
+ * so it is carried over to the next packet (or the end of the stream) and
+ * packets may be split anywhere. It is parsed right away though, so the
+ * picture information matches the packet for input split at NAL unit
+ * boundaries.
+ */
+static int ff_libde265dec_push_annexb(AVCodecContext *avctx, const uint8_t *data, int size, int64_t pts, int inspect)
+{
+    DE265Context *ctx = (DE265Context *) avctx->priv_data;
+    const uint8_t *end = data + size;
+    const uint8_t *nal;
+    int ret;
+
+    // start code split between the carried over data and this packet
+    int split = 0;
+    if (ctx->nal_buffer_len >= 1 && size >= 1) {
+        const uint8_t *tail = ctx->nal_buffer + ctx->nal_buffer_len;
+        if (ctx->nal_buffer_len >= 2 && tail[-2] == 0 && tail[-1] == 0 && data[0] == 1) {
+            split = 1;
+        } else if (size >= 2 && tail[-1] == 0 && data[0] == 0 && data[1] == 1) {
+            split = 2;
+        }
+    }
+
+    if (split) {
+        ctx->nal_buffer_len -= 3 - split;
+        if ((ret = ff_libde265dec_flush_annexb(avctx)) < 0) {
+            return ret;
+        }
+        nal = data + split;
+    } else {
+        const uint8_t *start = find_start_code(data, end);
+        if (ctx->nal_pending) {
+            // the data up to the first start code continues the last NAL unit
+            if ((ret = append_pending_nal(ctx, data, start - data)) < 0) {
+                return ret;
+            }
+            if (start == end) {
+                return 0;
+            }
+            if ((ret = ff_libde265dec_flush_annexb(avctx)) < 0) {
+                return ret;
+            }
+        } else {
+            for (const uint8_t *ptr = data; ptr < start; ptr++) {
+                // zero bytes are the leading zero of a 4 byte start code or padding
+                if (*ptr) {
+                    av_log(avctx, AV_LOG_WARNING, "Data doesn't start with a start code, skipping %d bytes\n",
+                           (int) (start - data));
+                    break;
+                }
+            }
+            if (start == end) {
+                // keep up to two zero bytes that might start a start code
+                int keep = LIBDE265_FFMPEG_MIN(size, 2);
+                if ((ret = append_pending_nal(ctx, end - keep, keep)) < 0) {
+                    return ret;
+                }
+                int zeros = 0;
+                while (zeros < 2 && zeros < ctx->nal_buffer_len &&
+                       ctx->nal_buffer[ctx->nal_buffer_len - 1 - zeros] == 0) {
+                    zeros++;
+                }
+                memmove(ctx->nal_buffer, ctx->nal_buffer + ctx->nal_buffer_len - zeros, zeros);
+                ctx->nal_buffer_len = zeros;
+                return 0;
+            }
+            ctx->nal_buffer_len = 0;
+        }
+        nal = start + 3;
+    }
+
+    const uint8_t *next;
+    while ((next = find_start_code(nal, end)) < end) {
+        if ((ret = ff_libde265dec_push_annexb_nal(avctx, nal, next, pts, inspect)) < 0) {
+            return ret;
+        }
+        nal = next + 3;
+    }
+
+    if (inspect) {
+        const uint8_t *nal_end = end;
+        while (nal_end > nal && nal_end[-1] == 0) {
+            nal_end--;
+        }
+        if (nal_end > nal && (ret = ff_libde265dec_parse_nal(avctx, nal, nal_end - nal)) < 0) {
+            return ret;
+        }
+    }
+    ctx->nal_buffer_len = 0;
+    if ((ret = append_pending_nal(ctx, nal, end - nal)) < 0) {
+        return ret;
+    }
+    ctx->nal_pending = 1;
+    ctx->nal_pts = pts;
+    return 0;
+}
+
+/**
+ * Insert an entry into the index, which is sorted by position. Entries
+ * for known positions are skipped, e.g. after seeking back.
+ */
+static int ff_libde265dec_add_index_entry(DE265Context *ctx, const LibDe265DecIndexEntry *entry)
+{
+    int pos = ctx->index_count;
+    while (pos > 0 && ctx->index[pos - 1].pos >= entry->pos) {
+        if (ctx->index[pos - 1].pos == entry->pos) {
+            return 0;
+        }
+        pos--;
+    }
+
+    LibDe265DecIndexEntry *index = (LibDe265DecIndexEntry *) av_fast_realloc(ctx->index, &ctx->index_size,
+                                                                             (ctx->index_count + 1) * sizeof(LibDe265DecIndexEntry));
+    if (index == NULL) {
+        return AVERROR(ENOMEM);
+    }
+    ctx->index = index;
+    memmove(&index[pos + 1], &index[pos], (ctx->index_count - pos) * sizeof(LibDe265DecIndexEntry));
+    index[pos] = *entry;
+    ctx->index_count++;
+    return 0;
+}
+
+// Record the current packet if it starts an IRAP picture or carries parameter sets.
+static int ff_libde265dec_update_index(DE265Context *ctx, int64_t pos, int64_t pts)
+{
+    LibDe265DecIndexEntry entry;
+    entry.flags = 0;
+    if (ctx->au.pictures && is_irap(ctx->au.nal_unit_type)) {
+        entry.flags |= LIBDE265DEC_INDEX_IRAP;
+    }
+    for (int i=0; i<3; i++) {
+        if (!(ctx->au.param_sets & (1 << i))) {
+            continue;
+        }
+        entry.flags |= LIBDE265DEC_INDEX_PARAMETER_SETS;
+        if (ctx->au.param_set_crc[i] != ctx->index_param_set_crc[i]) {
+            ctx->index_param_set_crc[i] = ctx->au.param_set_crc[i];
+            entry.flags |= LIBDE265DEC_INDEX_PARAMETER_SETS_CHANGED;
+        }
+    }
+    if (!entry.flags) {
+        return 0;
+    }
+
+    entry.pos = pos;
+    entry.pts = pts;
+    entry.nal_unit_type = ctx->au.pictures ? ctx->au.nal_unit_type : -1;
+    return ff_libde265dec_add_index_entry(ctx, &entry);
+}
+
+#if LIBDE265_NUMERIC_VERSION >= 0x00070000
+static void update_loop_filter(DE265Context *ctx, enum de265_param param, int level, int *disabled)
+{
+    if (needs_picture_info(level) && !ctx->au.pictures) {
+        // keep the current setting for packets without pictures
+        return;
+    }
+
+    int disable = discard_picture(&ctx->au, level);
+    if (disable != *disabled) {
+        *disabled = disable;
+        de265_set_parameter_bool(ctx->decoder, param, disable);
+    }
+}
+#endif
+
+// Copy of a decoded picture to an output frame, split in bands of rows.
+typedef struct DE265CopyJob {
+    AVFrame *picture;
+    int numplanes;
+    int bands;
+    const uint8_t *src[4];
+    int stride[4];
+    int height[4];
+    int size[4];
+    int mode[4];
+    int shift[4];
+} DE265CopyJob;
+
+static int ff_libde265dec_copy_band(AVCodecContext *avctx, void *arg, int jobnr, int threadnr)
+{
+    const DE265CopyJob *job = (const DE265CopyJob *) arg;
+    AVFrame *picture = job->picture;
+    for (int i=0; i<job->numplanes; i++) {
+        int start = job->height[i] * jobnr / job->bands;
+        int end = job->height[i] * (jobnr + 1) / job->bands;
+        int size = job->size[i];
+        int shift = job->shift[i];
+        const uint8_t* src_ptr = job->src[i] + start * job->stride[i];
+        uint8_t* dst_ptr = picture->data[i] + start * picture->linesize[i];
+        switch (job->mode[i]) {
+        case COPY_SHIFT_RIGHT:
+            for (int line = start; line < end; line++) {
+                const uint16_t *s = (const uint16_t *) src_ptr;
+                uint16_t *d = (uint16_t *) dst_ptr;
+                for (int pos=0; pos<size/2; pos++) {
+                    d[pos] = s[pos] >> shift;
+                }
+                src_ptr += job->stride[i];
+                dst_ptr += picture->linesize[i];
+            }
+            break;
+
+        case COPY_SHIFT_LEFT:
+            for (int line = start; line < end; line++) {
+                const uint16_t *s = (const uint16_t *) src_ptr;
+                uint16_t *d = (uint16_t *) dst_ptr;
+                for (int pos=0; pos<size/2; pos++) {
+                    d[pos] = s[pos] << shift;
+                }
+                src_ptr += job->stride[i];
+                dst_ptr += picture->linesize[i];
+            }
+            break;
+
+        case COPY_EXPAND_8BIT:
+            for (int line = start; line < end; line++) {
+                const uint8_t *s = src_ptr;
+                uint16_t *d = (uint16_t *) dst_ptr;
+                for (int pos=0; pos<size; pos++) {
+                    d[pos] = s[pos] << shift;
+                }
+                src_ptr += job->stride[i];
+                dst_ptr += picture->linesize[i];
+            }
+            break;
+
+        default:
+            av_image_copy_plane(dst_ptr, picture->linesize[i],
+                                src_ptr, job->stride[i], size, end - start);
+            break;
+        }
+    }
+    return 0;
+}
+
+static int get_band_count(AVCodecContext *avctx, int height)
+{
+    if (!(avctx->active_thread_type & FF_THREAD_SLICE)) {
+        return 1;
+    }
+    return LIBDE265_FFMPEG_MAX(1, LIBDE265_FFMPEG_MIN(avctx->thread_count, height / MIN_BAND_HEIGHT));
+}
+
+static inline enum AVPixelFormat get_output_format(int output_format) {
+    switch (output_format) {
+    case OUTPUT_RGB24:
+        return AV_PIX_FMT_RGB24;
+#if HAVE_FLOAT_OUTPUT
+    case OUTPUT_GBRPF32:
+        return AV_PIX_FMT_GBRPF32;
+#endif
+    default:
+        return AV_PIX_FMT_NONE;
+    }
+}
+
+// Conversion of a decoded picture to RGB, split in bands of rows.
+typedef struct DE265ConvertJob {
+    AVFrame *picture;
+    int output_format;
+    int width;
+    int height;
+    int bands;
+    int numplanes;
+    int log2_chroma_w;
+    int log2_chroma_h;
+    const uint8_t *src[3];
+    int stride[3];
+    int bits[3];
+    int luma_offset;
+    int chroma_offset;
+    // coefficients for luma, Cr -> R, Cb -> G, Cr -> G and Cb -> B
+    int32_t coeffs[5];
+    float float_coeffs[5];
+    // three rows of samples per band
+    int32_t *scratch;
+    // use the SIMD kernel (8 bit samples, three planes)
+    int simd;
+} DE265ConvertJob;
+
+static void init_conversion(AVCodecContext *avctx, DE265ConvertJob *job)
+{
+    DE265Context *ctx = (DE265Context *) avctx->priv_data;
+    int matrix = ctx->matrix;
+    if (matrix == MATRIX_AUTO) {
+        switch (avctx->colorspace) {
+        case AVCOL_SPC_BT709:
+            matrix = MATRIX_BT709;
+            break;
+        case AVCOL_SPC_BT470BG:
+        case AVCOL_SPC_SMPTE170M:
+            matrix = MATRIX_BT601;
+            break;
+        case AVCOL_SPC_BT2020_NCL:
+        case AVCOL_SPC_BT2020_CL:
+            matrix = MATRIX_BT2020;
+            break;
+        default:
+            matrix = (job->height > 576) ? MATRIX_BT709 : MATRIX_BT601;
+            break;
+        }
+    }
+    int full_range = (ctx->range == RANGE_FULL ||
+                      (ctx->range == RANGE_AUTO && avctx->color_range == AVCOL_RANGE_JPEG));
+
+    double kr, kb;
+    switch (matrix) {
+    case MATRIX_BT709:
+        kr = 0.2126;
+        kb = 0.0722;
+        break;
+    case MATRIX_BT2020:
+        kr = 0.2627;
+        kb = 0.0593;
+        break;
+    default:
+        kr = 0.299;
+        kb = 0.114;
+        break;
+    }
+    double kg = 1.0 - kr - kb;
+
+    int luma_bits = job->bits[0];
+    int chroma_bits = (job->numplanes > 1) ? job->bits[1] : luma_bits;
+    double luma_scale, chroma_scale;
+    if (full_range) {
+        job->luma_offset = 0;
+        luma_scale = 1.0 / ((1 << luma_bits) - 1);
+        chroma_scale = 1.0 / ((1 << chroma_bits) - 1);
+    } else {
+        job->luma_offset = 16 << (luma_bits - 8);
+        luma_scale = 1.0 / (219 << (luma_bits - 8));
+        chroma_scale = 1.0 / (224 << (chroma_bits - 8));
+    }
+    job->chroma_offset = 1 << (chroma_bits - 1);
+
+    double coeffs[5];
+    coeffs[0] = luma_scale;
+    coeffs[1] = 2.0 * (1.0 - kr) * chroma_scale;
+    coeffs[2] = -2.0 * kb * (1.0 - kb) / kg * chroma_scale;
+    coeffs[3] = -2.0 * kr * (1.0 - kr) / kg * chroma_scale;
+    coeffs[4] = 2.0 * (1.0 - kb) * chroma_scale;
+    for (int i=0; i<5; i++) {
+        job->coeffs[i] = (int32_t) lrint(coeffs[i] * 255.0 * (1 << CONVERT_BITS));
+        job->float_coeffs[i] = (float) coeffs[i];
+    }
+}
+
+// Load samples "start" to "width" of a row, chroma is upsampled by repeating samples.
+static void load_row(int32_t *dst, const uint8_t *src, int bits, int start, int width, int log2_chroma_w)
+{
+    if (bits > 8) {
+        const uint16_t *s = (const uint16_t *) src;
+        for (int x=start; x<width; x++) {
+            dst[x] = s[x >> log2_chroma_w];
+        }
+    } else {
+        for (int x=start; x<width; x++) {
+            dst[x] = src[x >> log2_chroma_w];
+        }
+    }
+}
+
+static void convert_row_rgb24(const DE265ConvertJob *job, int start, const int32_t *y, const int32_t *cb, const int32_t *cr, uint8_t *dst)
+{
+    const int32_t *k = job->coeffs;
+    for (int x=start; x<job->width; x++) {
+        int32_t luma = (y[x] - job->luma_offset) * k[0] + (1 << (CONVERT_BITS - 1));
+        int32_t u = cb[x] - job->chroma_offset;
+        int32_t v = cr[x] - job->chroma_offset;
+        dst[3 * x + 0] = av_clip_uint8((luma + k[1] * v) >> CONVERT_BITS);
+        dst[3 * x + 1] = av_clip_uint8((luma + k[2] * u + k[3] * v) >> CONVERT_BITS);
+        dst[3 * x + 2] = av_clip_uint8((luma + k[4] * u) >> CONVERT_BITS);
+    }
+}
+
+static inline float clip_unit(float value) {
+    return value < 0.0f ? 0.0f : (value > 1.0f ? 1.0f : value);
+}
+
+static void convert_row_float(const DE265ConvertJob *job, int start, const int32_t *y, const int32_t *cb, const int32_t *cr,
+                              float *r, float *g, float *b)
+{
+    const float *k = job->float_coeffs;
+    for (int x=start; x<job->width; x++) {
+        float luma = (float) (y[x] - job->luma_offset) * k[0];
+        float u = (float) (cb[x] - job->chroma_offset);
+        float v = (float) (cr[x] - job->chroma_offset);
+        r[x] = clip_unit(luma + k[1] * v);
+        g[x] = clip_unit(luma + k[2] * u + k[3] * v);
+        b[x] = clip_unit(luma + k[4] * u);
+    }
+}
+
+/*
+ * The SIMD kernels convert 8 bit pictures with three planes directly from
+ * the decoded planes in blocks of 16 pixels, using single precision math.
+ * They return the number of converted pixels and always leave at least one
+ * pixel to the C versions above. RGB24 values may differ by one from the
+ * fixed point C version if they are exactly between two integers.
+ */
+#if HAVE_SSE2_INTRINSICS
+static inline void widen_sse2(__m128i v, __m128 out[4]) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_unpacklo_epi8(v, zero);
+    __m128i hi = _mm_unpackhi_epi8(v, zero);
+    out[0] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero));
+    out[1] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero));
+    out[2] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero));
+    out[3] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero));
+}
+
+static inline __m128i narrow_sse2(const __m128 v[4]) {
+    __m128i lo = _mm_packs_epi32(_mm_cvtps_epi32(v[0]), _mm_cvtps_epi32(v[1]));
+    __m128i hi = _mm_packs_epi32(_mm_cvtps_epi32(v[2]), _mm_cvtps_epi32(v[3]));
+    return _mm_packus_epi16(lo, hi);
+}
+
+static int convert_row_sse2(const DE265ConvertJob *job, const uint8_t *y, const uint8_t *cb, const uint8_t *cr,
+                            uint8_t *const dst[3])
+{
+    const float scale = (job->output_format == OUTPUT_RGB24) ? 255.0f : 1.0f;
+    const __m128 k0 = _mm_set1_ps(job->float_coeffs[0] * scale);
+    const __m128 k1 = _mm_set1_ps(job->float_coeffs[1] * scale);
+    const __m128 k2 = _mm_set1_ps(job->float_coeffs[2] * scale);
+    const __m128 k3 = _mm_set1_ps(job->float_coeffs[3] * scale);
+    const __m128 k4 = _mm_set1_ps(job->float_coeffs[4] * scale);
+    const __m128 luma_offset = _mm_set1_ps((float) job->luma_offset);
+    const __m128 chroma_offset = _mm_set1_ps((float) job->chroma_offset);
+    const __m128 zero_ps = _mm_setzero_ps();
+    const __m128 one_ps = _mm_set1_ps(1.0f);
+    const __m128i zero = _mm_setzero_si128();
+    int x;
+
+    for (x=0; x + 16 < job->width; x += 16) {
+        __m128i y8 = _mm_loadu_si128((const __m128i *) (y + x));
+        __m128i u8, v8;
+        if (job->log2_chroma_w) {
+            u8 = _mm_loadl_epi64((const __m128i *) (cb + (x >> 1)));
+            v8 = _mm_loadl_epi64((const __m128i *) (cr + (x >> 1)));
+            u8 = _mm_unpacklo_epi8(u8, u8);
+            v8 = _mm_unpacklo_epi8(v8, v8);
+        } else {
+            u8 = _mm_loadu_si128((const __m128i *) (cb + x));
+            v8 = _mm_loadu_si128((const __m128i *) (cr + x));
+        }
+
+        __m128 yf[4], uf[4], vf[4], r[4], g[4], b[4];
+        widen_sse2(y8, yf);
+        widen_sse2(u8, uf);
+        widen_sse2(v8, vf);
+        for (int i=0; i<4; i++) {
+            __m128 luma = _mm_mul_ps(_mm_sub_ps(yf[i], luma_offset), k0);
+            __m128 u = _mm_sub_ps(uf[i], chroma_offset);
+            __m128 v = _mm_sub_ps(vf[i], chroma_offset);
+            r[i] = _mm_add_ps(luma, _mm_mul_ps(k1, v));
+            g[i] = _mm_add_ps(luma, _mm_add_ps(_mm_mul_ps(k2, u), _mm_mul_ps(k3, v)));
+            b[i] = _mm_add_ps(luma, _mm_mul_ps(k4, u));
+        }
+
+        if (job->output_format == OUTPUT_RGB24) {
+            __m128i r8 = narrow_sse2(r);
+            __m128i g8 = narrow_sse2(g);
+            __m128i b8 = narrow_sse2(b);
+            __m128i rg_lo = _mm_unpacklo_epi8(r8, g8);
+            __m128i rg_hi = _mm_unpackhi_epi8(r8, g8);
+            __m128i b_lo = _mm_unpacklo_epi8(b8, zero);
+            __m128i b_hi = _mm_unpackhi_epi8(b8, zero);
+            uint32_t pixels[16];
+            _mm_storeu_si128((__m128i *) pixels, _mm_unpacklo_epi16(rg_lo, b_lo));
+            _mm_storeu_si128((__m128i *) (pixels + 4), _mm_unpackhi_epi16(rg_lo, b_lo));
+            _mm_storeu_si128((__m128i *) (pixels + 8), _mm_unpacklo_epi16(rg_hi, b_hi));
+            _mm_storeu_si128((__m128i *) (pixels + 12), _mm_unpackhi_epi16(rg_hi, b_hi));
+            // SSE2 has no byte shuffle, write R, G, B, 0 for every pixel with
+            // the fourth byte being overwritten by the next pixel
+            uint8_t *d = dst[0] + 3 * x;
+            for (int i=0; i<16; i++) {
+                memcpy(d + 3 * i, &pixels[i], 4);
+            }
+        } else {
+            for (int i=0; i<4; i++) {
+                _mm_storeu_ps((float *) dst[0] + x + 4 * i, _mm_min_ps(_mm_max_ps(r[i], zero_ps), one_ps));
+                _mm_storeu_ps((float *) dst[1] + x + 4 * i, _mm_min_ps(_mm_max_ps(g[i], zero_ps), one_ps));
+                _mm_storeu_ps((float *) dst[2] + x + 4 * i, _mm_min_ps(_mm_max_ps(b[i], zero_ps), one_ps));
+            }
+        }
+    }
+    return x;
+}
+#endif
+
+#if HAVE_NEON_INTRINSICS
+static inline void widen_neon(uint8x16_t v, float32x4_t out[4]) {
+    uint16x8_t lo = vmovl_u8(vget_low_u8(v));
+    uint16x8_t hi = vmovl_u8(vget_high_u8(v));
+    out[0] = vcvtq_f32_u32(vmovl_u16(vget_low_u16(lo)));
+    out[1] = vcvtq_f32_u32(vmovl_u16(vget_high_u16(lo)));
+    out[2] = vcvtq_f32_u32(vmovl_u16(vget_low_u16(hi)));
+    out[3] = vcvtq_f32_u32(vmovl_u16(vget_high_u16(hi)));
+}
+
+static inline uint8x16_t narrow_neon(const float32x4_t v[4]) {
+    uint16x8_t lo = vcombine_u16(vqmovun_s32(vcvtnq_s32_f32(v[0])), vqmovun_s32(vcvtnq_s32_f32(v[1])));
+    uint16x8_t hi = vcombine_u16(vqmovun_s32(vcvtnq_s32_f32(v[2])), vqmovun_s32(vcvtnq_s32_f32(v[3])));
+    return vcombine_u8(vqmovn_u16(lo), vqmovn_u16(hi));
+}
+
+static int convert_row_neon(const DE265ConvertJob *job, const uint8_t *y, const uint8_t *cb, const uint8_t *cr,
+                            uint8_t *const dst[3])
+{
+    const float scale = (job->output_format == OUTPUT_RGB24) ? 255.0f : 1.0f;
+    const float k0 = job->float_coeffs[0] * scale;
+    const float k1 = job->float_coeffs[1] * scale;
+    const float k2 = job->float_coeffs[2] * scale;
+    const float k3 = job->float_coeffs[3] * scale;
+    const float k4 = job->float_coeffs[4] * scale;
+    const float32x4_t luma_offset = vdupq_n_f32((float) job->luma_offset);
+    const float32x4_t chroma_offset = vdupq_n_f32((float) job->chroma_offset);
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    int x;
+
+    for (x=0; x + 16 < job->width; x += 16) {
+        uint8x16_t y8 = vld1q_u8(y + x);
+        uint8x16_t u8, v8;
+        if (job->log2_chroma_w) {
+            uint8x8_t u = vld1_u8(cb + (x >> 1));
+            uint8x8_t v = vld1_u8(cr + (x >> 1));
+            u8 = vcombine_u8(vzip1_u8(u, u), vzip2_u8(u, u));
+            v8 = vcombine_u8(vzip1_u8(v, v), vzip2_u8(v, v));
+        } else {
+            u8 = vld1q_u8(cb + x);
+            v8 = vld1q_u8(cr + x);
+        }
+
+        float32x4_t yf[4], uf[4], vf[4], r[4], g[4], b[4];
+        widen_neon(y8, yf);
+        widen_neon(u8, uf);
+        widen_neon(v8, vf);
+        for (int i=0; i<4; i++) {
+            float32x4_t luma = vmulq_n_f32(vsubq_f32(yf[i], luma_offset), k0);
+            float32x4_t u = vsubq_f32(uf[i], chroma_offset);
+            float32x4_t v = vsubq_f32(vf[i], chroma_offset);
+            r[i] = vmlaq_n_f32(luma, v, k1);
+            g[i] = vmlaq_n_f32(vmlaq_n_f32(luma, u, k2), v, k3);
+            b[i] = vmlaq_n_f32(luma, u, k4);
+        }
+
+        if (job->output_format == OUTPUT_RGB24) {
+            uint8x16x3_t rgb;
+            rgb.val[0] = narrow_neon(r);
+            rgb.val[1] = narrow_neon(g);
+            rgb.val[2] = narrow_neon(b);
+            vst3q_u8(dst[0] + 3 * x, rgb);
+        } else {
+            for (int i=0; i<4; i++) {
+                vst1q_f32((float *) dst[0] + x + 4 * i, vminq_f32(vmaxq_f32(r[i], zero), one));
+                vst1q_f32((float *) dst[1] + x + 4 * i, vminq_f32(vmaxq_f32(g[i], zero), one));
+                vst1q_f32((float *) dst[2] + x + 4 * i, vminq_f32(vmaxq_f32(b[i], zero), one));
+            }
+        }
+    }
+    return x;
+}
+#endif
+
+#if HAVE_SSE2_INTRINSICS
+#define convert_row_simd convert_row_sse2
+#elif HAVE_NEON_INTRINSICS
+#define convert_row_simd convert_row_neon
+#endif
+
+static int ff_libde265dec_convert_band(AVCodecContext *avctx, void *arg, int jobnr, int threadnr)
+{
+    const DE265ConvertJob *job = (const DE265ConvertJob *) arg;
+    AVFrame *picture = job->picture;
+    int32_t *y = job->scratch + (size_t) jobnr * 3 * job->width;
+    int32_t *cb = y + job->width;
+    int32_t *cr = cb + job->width;
+    int start = job->height * jobnr / job->bands;
+    int end = job->height * (jobnr + 1) / job->bands;
+
+    if (job->numplanes == 1) {
+        // monochrome, neutral chroma
+        for (int x=0; x<job->width; x++) {
+            cb[x] = cr[x] = job->chroma_offset;
+        }
+    }
+    for (int line = start; line < end; line++) {
+        const uint8_t *src[3];
+        uint8_t *dst[3];
+        src[0] = job->src[0] + line * job->stride[0];
+        if (job->numplanes > 1) {
+            int chroma_line = line >> job->log2_chroma_h;
+            src[1] = job->src[1] + chroma_line * job->stride[1];
+            src[2] = job->src[2] + chroma_line * job->stride[2];
+        }
+        if (job->output_format == OUTPUT_RGB24) {
+            dst[0] = picture->data[0] + line * picture->linesize[0];
+        } else {
+            // planes are stored in G, B, R order
+            dst[0] = picture->data[2] + line * picture->linesize[2];
+            dst[1] = picture->data[0] + line * picture->linesize[0];
+            dst[2] = picture->data[1] + line * picture->linesize[1];
+        }
+
+        int x = 0;
+#ifdef convert_row_simd
+        if (job->simd) {
+            x = convert_row_simd(job, src[0], src[1], src[2], dst);
+        }
+#endif
+        load_row(y, src[0], job->bits[0], x, job->width, 0);
+        if (job->numplanes > 1) {
+            load_row(cb, src[1], job->bits[1], x, job->width, job->log2_chroma_w);
+            load_row(cr, src[2], job->bits[2], x, job->width, job->log2_chroma_w);
+        }
+        if (job->output_format == OUTPUT_RGB24) {
+            convert_row_rgb24(job, x, y, cb, cr, dst[0]);
+        } else {
+            convert_row_float(job, x, y, cb, cr, (float *) dst[0], (float *) dst[1], (float *) dst[2]);
+        }
+    }
+    return 0;
+}
+
+static void ff_libde265dec_free_nothing(void *opaque, uint8_t *data)
+{
+    // memory is owned by the application
+}
+
+/**
+ * Convert a decoded picture to the configured output format. Planar float
+ * pictures are written to the next slot of the batch buffer if one is set.
+ */
+static int ff_libde265dec_convert_picture(AVCodecContext *avctx, const struct de265_image *img, AVFrame *picture)
+{
+    DE265Context *ctx = (DE265Context *) avctx->priv_data;
+    enum de265_chroma chroma = de265_get_chroma_format(img);
+    DE265ConvertJob job;
+    int ret;
+
+    job.picture = picture;
+    job.output_format = ctx->output_format;
+    job.width = avctx->width;
+    job.height = avctx->height;
+    job.numplanes = (chroma == de265_chroma_mono ? 1 : 3);
+    job.log2_chroma_w = (chroma == de265_chroma_420 || chroma == de265_chroma_422) ? 1 : 0;
+    job.log2_chroma_h = (chroma == de265_chroma_420) ? 1 : 0;
+    for (int i=0; i<job.numplanes; i++) {
+        job.src[i] = de265_get_image_plane(img, i, &job.stride[i]);
+        job.bits[i] = de265_get_bits_per_pixel(img, i);
+        if (job.bits[i] < 8 || job.bits[i] > 16) {
+            return AVERROR_INVALIDDATA;
+        }
+    }
+    init_conversion(avctx, &job);
+    job.simd = (job.numplanes == 3 && job.bits[0] == 8 && job.bits[1] == 8 && job.bits[2] == 8);
+
+    picture->width = job.width;
+    picture->height = job.height;
+    picture->format = avctx->pix_fmt;
+    if (ctx->output_format == OUTPUT_GBRPF32 && ctx->batch_buffer != NULL &&
+        ctx->batch_width == job.width && ctx->batch_height == job.height) {
+        size_t plane_size = (size_t) job.width * job.height;
+        float *slot = ctx->batch_buffer + (size_t) ctx->batch_index * 3 * plane_size;
+        picture->buf[0] = av_buffer_create((uint8_t *) slot, 3 * plane_size * sizeof(float),
+                                           ff_libde265dec_free_nothing, NULL, 0);
+        if (picture->buf[0] == NULL) {
+            return AVERROR(ENOMEM);
+        }
+        // the slot contains the R, G and B planes
+        picture->data[0] = (uint8_t *) (slot + plane_size);
+        picture->data[1] = (uint8_t *) (slot + 2 * plane_size);
+        picture->data[2] = (uint8_t *) slot;
+        for (int i=0; i<3; i++) {
+            picture->linesize[i] = job.width * sizeof(float);
+        }
+        picture->extended_data = picture->data;
+        ctx->batch_index = (ctx->batch_index + 1) % ctx->batch_count;
+    } else {
+        if (ctx->batch_buffer != NULL) {
+            av_log(avctx, AV_LOG_WARNING, "Picture doesn't fit into batch buffer (%dx%d != %dx%d)\n",
+                   job.width, job.height, ctx->batch_width, ctx->batch_height);
+        }
+        if (avctx->get_buffer2 != NULL) {
+            ret = avctx->get_buffer2(avctx, picture, 0);
+        } else {
+            ret = av_frame_get_buffer(picture, 32);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    job.bands = get_band_count(avctx, job.height);
+    av_fast_malloc(&ctx->convert_buffer, &ctx->convert_buffer_size,
+                   (size_t) job.bands * 3 * job.width * sizeof(int32_t));
+    if (ctx->convert_buffer == NULL) {
+        av_frame_unref(picture);
+        return AVERROR(ENOMEM);
+    }
+    job.scratch = ctx->convert_buffer;
+    avctx->execute2(avctx, ff_libde265dec_convert_band, &job, NULL, job.bands);
+    return 0;
+}
+
+// Return the decoder context for public API calls.
+static DE265Context *get_api_context(AVCodecContext *avctx) {
+    if (avctx->codec != &ff_libde265_decoder) {
+        return NULL;
+    }
+    return (DE265Context *) avctx->priv_data;
+}
+
+int libde265dec_set_batch_buffer(AVCodecContext *avctx, float *buffer, int width, int height, int count)
+{
+    DE265Context *ctx = get_api_context(avctx);
+    if (ctx == NULL || (buffer != NULL && (width <= 0 || height <= 0 || count <= 0))) {
+        return AVERROR(EINVAL);
+    }
+    ctx->batch_buffer = buffer;
+    ctx->batch_width = width;
+    ctx->batch_height = height;
+    ctx->batch_count = count;
+    ctx->batch_index = 0;
+    return 0;
+}
+
+int libde265dec_set_ring(AVCodecContext *avctx, uint8_t *const *slots, int count,
+                         int width, int height, enum AVPixelFormat format, const int linesizes[4])
+{
+#if LIBDE265_NUMERIC_VERSION >= 0x00070000
+    DE265Context *ctx = get_api_context(avctx);
+    if (ctx == NULL || count < 0 || count > MAX_RING_SLOTS || (count > 0 && slots == NULL)) {
+        return AVERROR(EINVAL);
+    }
+    for (int i=0; i<ctx->ring_count; i++) {
+        if (load_acquire(&ctx->ring[i].decoding) || ctx->ring[i].completed) {
+            return AVERROR(EBUSY);
+        }
+    }
+
+    AVBufferRef *state = NULL;
+    int size = 0;
+    if (count > 0) {
+        int min_linesizes[4];
+        uint8_t *data[4];
+        if (width <= 0 || height <= 0 || av_image_fill_linesizes(min_linesizes, format, width) < 0) {
+            return AVERROR(EINVAL);
+        }
+        for (int i=0; i<4; i++) {
+            // libde265 writes "width" samples into every line
+            if (linesizes[i] < min_linesizes[i]) {
+                return AVERROR(EINVAL);
+            }
+        }
+        size = av_image_fill_pointers(data, format, height, NULL, linesizes);
+        if (size <= 0) {
+            return AVERROR(EINVAL);
+        }
+        for (int i=0; i<count; i++) {
+            if (slots[i] == NULL) {
+                return AVERROR(EINVAL);
+            }
+        }
+        state = av_buffer_allocz(MAX_RING_SLOTS * sizeof(DE265RingSlot));
+        if (state == NULL) {
+            return AVERROR(ENOMEM);
+        }
+    }
+
+    av_buffer_unref(&ctx->ring_state);
+    ctx->ring_state = state;
+    ctx->ring = NULL;
+    ctx->ring_count = 0;
+    ctx->ring_done_count = 0;
+    if (count == 0) {
+        return 0;
+    }
+
+    ctx->ring = (DE265RingSlot *) state->data;
+    for (int i=0; i<count; i++) {
+        ctx->ring[i].data = slots[i];
+    }
+    for (int i=0; i<4; i++) {
+        ctx->ring_linesize[i] = linesizes[i];
+    }
+    ctx->ring_width = width;
+    ctx->ring_height = height;
+    ctx->ring_format = format;
+    ctx->ring_slot_size = size;
+    ctx->ring_count = count;
+    return 0;
+#else
+    return AVERROR(ENOSYS);
+#endif
+}
+
+int libde265dec_receive_ring_frames(AVCodecContext *avctx, LibDe265DecRingFrame *frames, int max_frames)
+{
+    DE265Context *ctx = get_api_context(avctx);
+    if (ctx == NULL || max_frames < 0) {
+        return AVERROR(EINVAL);
+    }
+
+    int count = LIBDE265_FFMPEG_MIN(max_frames, ctx->ring_done_count);
+    memcpy(frames, ctx->ring_done, count * sizeof(LibDe265DecRingFrame));
+    ctx->ring_done_count -= count;
+    if (ctx->ring_done_count > 0) {
+        memmove(ctx->ring_done, &ctx->ring_done[count], ctx->ring_done_count * sizeof(LibDe265DecRingFrame));
+    }
+    return count;
+}
+
+int libde265dec_release_ring_slot(AVCodecContext *avctx, int slot)
+{
+    DE265Context *ctx = get_api_context(avctx);
+    if (ctx == NULL || slot < 0 || slot >= ctx->ring_count || !ctx->ring[slot].completed) {
+        return AVERROR(EINVAL);
+    }
+
+    // the slot might still be in the list of frames not received yet
+    for (int i=0; i<ctx->ring_done_count; i++) {
+        if (ctx->ring_done[i].slot == slot) {
+            ctx->ring_done_count--;
+            memmove(&ctx->ring_done[i], &ctx->ring_done[i + 1], (ctx->ring_done_count - i) * sizeof(LibDe265DecRingFrame));
+            break;
+        }
+    }
+    ctx->ring[slot].completed = 0;
+    return 0;
+}
+
+int libde265dec_get_index(AVCodecContext *avctx, const LibDe265DecIndexEntry **entries)
+{
+    DE265Context *ctx = get_api_context(avctx);
+    if (ctx == NULL) {
+        return AVERROR(EINVAL);
+    }
+
+    *entries = ctx->index;
+    return ctx->index_count;
+}
+
+int libde265dec_set_index_position(AVCodecContext *avctx, int64_t pos)
+{
+    DE265Context *ctx = get_api_context(avctx);
+    if (ctx == NULL || pos < 0) {
+        return AVERROR(EINVAL);
+    }
+
+    ctx->index_stream_pos = pos;
+    return 0;
+}
+
+int libde265dec_find_index_entry(AVCodecContext *avctx, int64_t pts)
+{
+    DE265Context *ctx = get_api_context(avctx);
+    if (ctx == NULL || pts == AV_NOPTS_VALUE) {
+        return AVERROR(EINVAL);
+    }
+
+    int found = AVERROR(ENOENT);
+    for (int i=0; i<ctx->index_count; i++) {
+        const LibDe265DecIndexEntry *entry = &ctx->index[i];
+        if ((entry->flags & LIBDE265DEC_INDEX_IRAP) && entry->pts != AV_NOPTS_VALUE && entry->pts <= pts &&
+            (found < 0 || entry->pts >= ctx->index[found].pts)) {
+            found = i;
+        }
+    }
+    return found;
+}
+
+static inline uint8_t *write_varint(uint8_t *dst, uint64_t value) {
+    while (value >= 0x80) {
+        *dst++ = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    *dst++ = value;
+    return dst;
+}
+
+static inline int read_varint(const uint8_t **ptr, const uint8_t *end, uint64_t *value) {
+    *value = 0;
+    for (int shift=0; shift<64; shift+=7) {
+        if (*ptr >= end) {
+            return AVERROR_INVALIDDATA;
+        }
+        uint8_t b = *(*ptr)++;
+        *value |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return 0;
+        }
+    }
+    return AVERROR_INVALIDDATA;
+}
+
+/*
+ * Serialized index: magic, version byte, varint entry count and for every
+ * entry the varint position delta, a varint with the flags, a "has pts"
+ * bit and the NAL unit type + 1, and the zigzag encoded pts delta.
+ */
+#define INDEX_MAGIC         "DE265IDX"
+#define INDEX_MAGIC_SIZE    8
+#define INDEX_VERSION       1
+#define INDEX_FLAGS         (LIBDE265DEC_INDEX_IRAP | LIBDE265DEC_INDEX_PARAMETER_SETS | \
+                             LIBDE265DEC_INDEX_PARAMETER_SETS_CHANGED)
+#define INDEX_HAS_PTS       8
+#define INDEX_TYPE_SHIFT    4
+#define MAX_VARINT_SIZE     10
+
+int libde265dec_export_index(AVCodecContext *avctx, uint8_t **data, int *size)
+{
+    DE265Context *ctx = get_api_context(avctx);
+    if (ctx == NULL || ctx->index_count > (INT_MAX - INDEX_MAGIC_SIZE - 1 - MAX_VARINT_SIZE) / (3 * MAX_VARINT_SIZE)) {
+        return AVERROR(EINVAL);
+    }
+
+    uint8_t *buffer = (uint8_t *) av_malloc(INDEX_MAGIC_SIZE + 1 + MAX_VARINT_SIZE + ctx->index_count * 3 * MAX_VARINT_SIZE);
+    if (buffer == NULL) {
+        return AVERROR(ENOMEM);
+    }
+
+    uint8_t *dst = buffer;
+    memcpy(dst, INDEX_MAGIC, INDEX_MAGIC_SIZE);
+    dst += INDEX_MAGIC_SIZE;
+    *dst++ = INDEX_VERSION;
+    dst = write_varint(dst, ctx->index_count);
+    int64_t last_pos = 0;
+    int64_t last_pts = 0;
+    for (int i=0; i<ctx->index_count; i++) {
+        const LibDe265DecIndexEntry *entry = &ctx->index[i];
+        int has_pts = (entry->pts != AV_NOPTS_VALUE);
+        dst = write_varint(dst, entry->pos - last_pos);
+        dst = write_varint(dst, entry->flags | (has_pts ? INDEX_HAS_PTS : 0) | ((entry->nal_unit_type + 1) << INDEX_TYPE_SHIFT));
+        if (has_pts) {
+            int64_t delta = entry->pts - last_pts;
+            dst = write_varint(dst, ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63));
+            last_pts = entry->pts;
+        }
+        last_pos = entry->pos;
+    }
+
+    *data = buffer;
+    *size = dst - buffer;
+    return 0;
+}
+
+int libde265dec_import_index(AVCodecContext *avctx, const uint8_t *data, int size)
+{
+    DE265Context *ctx = get_api_context(avctx);
+    if (ctx == NULL || data == NULL) {
+        return AVERROR(EINVAL);
+    }
+    if (size < INDEX_MAGIC_SIZE + 1 || memcmp(data, INDEX_MAGIC, INDEX_MAGIC_SIZE)) {
+        av_log(avctx, AV_LOG_ERROR, "Invalid index data\n");
+        return AVERROR_INVALIDDATA;
+    }
+    if (data[INDEX_MAGIC_SIZE] != INDEX_VERSION) {
+        av_log(avctx, AV_LOG_ERROR, "Unsupported index version %d\n", data[INDEX_MAGIC_SIZE]);
+        return AVERROR_PATCHWELCOME;
+    }
+
+    const uint8_t *ptr = data + INDEX_MAGIC_SIZE + 1;
+    const uint8_t *end = data + size;
+    uint64_t count;
+    int ret = read_varint(&ptr, end, &count);
+    if (ret < 0 || count > (uint64_t) (end - ptr) / 2) {
+        av_log(avctx, AV_LOG_ERROR, "Invalid index data\n");
+        return AVERROR_INVALIDDATA;
+    }
+
+    LibDe265DecIndexEntry entry;
+    entry.pos = 0;
+    entry.pts = 0;
+    int64_t last_pts = 0;
+    for (uint64_t i=0; i<count; i++) {
+        uint64_t delta, header;
+        if (read_varint(&ptr, end, &delta) < 0 || read_varint(&ptr, end, &header) < 0 ||
+            (header >> INDEX_TYPE_SHIFT) > 64 || delta > (uint64_t) (INT64_MAX - entry.pos)) {
+            av_log(avctx, AV_LOG_ERROR, "Invalid index data\n");
+            return AVERROR_INVALIDDATA;
+        }
+        entry.pos += delta;
+        entry.flags = header & INDEX_FLAGS;
+        entry.nal_unit_type = (int) (header >> INDEX_TYPE_SHIFT) - 1;
+        if (header & INDEX_HAS_PTS) {
+            if (read_varint(&ptr, end, &delta) < 0) {
+                av_log(avctx, AV_LOG_ERROR, "Invalid index data\n");
+                return AVERROR_INVALIDDATA;
+            }
+            last_pts += (int64_t) ((delta >> 1) ^ -(delta & 1));
+            entry.pts = last_pts;
+        } else {
+            entry.pts = AV_NOPTS_VALUE;
+        }
+        ret = ff_libde265dec_add_index_entry(ctx, &entry);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Return a frame for the picture started in the current packet. The frame
+ * contains the stream information and metadata, its pixel data is shared
+ * between all frames and never filled.
+ */
+static int ff_libde265dec_output_probe_frame(AVCodecContext *avctx, AVFrame *picture, int *got_frame, int64_t pts)
+{
+    DE265Context *ctx = (DE265Context *) avctx->priv_data;
+    AVFrame *frame = ctx->probe_frame;
+    int ret;
+
+    if (!ctx->au.pictures || avctx->pix_fmt == AV_PIX_FMT_NONE || avctx->width == 0) {
+        return 0;
+    }
+
+    if (frame->width != avctx->width || frame->height != avctx->height || frame->format != avctx->pix_fmt) {
+        av_frame_unref(frame);
+        frame->width = avctx->width;
+        frame->height = avctx->height;
+        frame->format = avctx->pix_fmt;
+        if ((ret = av_frame_get_buffer(frame, 32)) < 0) {
+            return ret;
+        }
+        for (int i=0; i<AV_NUM_DATA_POINTERS && frame->buf[i]; i++) {
+            memset(frame->buf[i]->data, 0, frame->buf[i]->size);
+        }
+    }
+
+    if ((ret = av_frame_ref(picture, frame)) < 0) {
+        return ret;
+    }
+    picture->key_frame = is_irap(ctx->au.nal_unit_type);
+    switch (ctx->au.slice_type) {
+    case 0:
+        picture->pict_type = AV_PICTURE_TYPE_B;
+        break;
+    case 1:
+        picture->pict_type = AV_PICTURE_TYPE_P;
+        break;
+    default:
+        picture->pict_type = AV_PICTURE_TYPE_I;
+        break;
+    }
+    picture->sample_aspect_ratio = avctx->sample_aspect_ratio;
+
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(55, 28, 100)
+    if (ctx->mastering_present) {
+        // SEI primaries are in G, B, R order
+        static const int mapping[3] = { 2, 0, 1 };
+        AVMasteringDisplayMetadata *metadata = av_mastering_display_metadata_create_side_data(picture);
+        if (metadata == NULL) {
+            av_frame_unref(picture);
+            return AVERROR(ENOMEM);
+        }
+        for (int i=0; i<3; i++) {
+            metadata->display_primaries[i][0] = av_make_q(ctx->mastering_primaries[mapping[i]][0], 50000);
+            metadata->display_primaries[i][1] = av_make_q(ctx->mastering_primaries[mapping[i]][1], 50000);
+        }
+        metadata->white_point[0] = av_make_q(ctx->mastering_white_point[0], 50000);
+        metadata->white_point[1] = av_make_q(ctx->mastering_white_point[1], 50000);
+        metadata->max_luminance = av_make_q(ctx->mastering_max_luminance, 10000);
+        metadata->min_luminance = av_make_q(ctx->mastering_min_luminance, 10000);
+        metadata->has_primaries = 1;
+        metadata->has_luminance = 1;
+    }
+#endif
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(55, 78, 100)
+    if (ctx->light_level_present) {
+        AVContentLightMetadata *light = av_content_light_metadata_create_side_data(picture);
+        if (light == NULL) {
+            av_frame_unref(picture);
+            return AVERROR(ENOMEM);
+        }
+        light->MaxCLL = ctx->max_content_light_level;
+        light->MaxFALL = ctx->max_pic_average_light_level;
+    }
+#endif
+    if (ctx->timecode[0]) {
+        av_dict_set(&picture->metadata, "timecode", ctx->timecode, 0);
+        ctx->timecode[0] = 0;
+    }
+
+    *got_frame = 1;
+    picture->reordered_opaque = pts;
+    picture->pkt_pts = pts;
+    return 0;
+}
+
+
+static int ff_libde265dec_decode(AVCodecContext *avctx,
+                                 void *data, int *got_frame, AVPacket *avpkt)
+{
+    DE265Context *ctx = (DE265Context *) avctx->priv_data;
+    AVFrame *picture = (AVFrame *) data;
+    const struct de265_image *img;
+    de265_error err;
+    int ret;
+    int64_t pts;
+    int more = 0;
+
+    const uint8_t* src[4];
+    int stride[4];
+
+    if (ctx->check_extra) {
+        int extradata_size = avctx->extradata_size;
+        ctx->check_extra = 0;
+        if (extradata_size > 0) {
+            unsigned char *extradata = (unsigned char *) avctx->extradata;
+            if (extradata_size > 3 && extradata != NULL && (extradata[0] || extradata[1] || extradata[2] > 1)) {
+                ctx->packetized = 1;
+                if (extradata_size > 22) {
+                    if (extradata[0] != 0) {
+                        av_log(avctx, AV_LOG_WARNING, "Unsupported extra data version %d, decoding may fail\n", extradata[0]);
+                    }
+                    ctx->length_size = (extradata[21] & 3) + 1;
+                    int num_param_sets = extradata[22];
+                    int pos = 23;
+                    for (int i=0; i<num_param_sets; i++) {
+                        if (pos + 3 > extradata_size) {
+                            av_log(avctx, AV_LOG_ERROR, "Buffer underrun in extra header (%d >= %d)\n", pos + 3, extradata_size);
+                            return AVERROR_INVALIDDATA;
+                        }
+                        // ignore flags + NAL type (1 byte)
+                        int nal_count  = extradata[pos+1] << 8 | extradata[pos+2];
+                        pos += 3;
+                        for (int j=0; j<nal_count; j++) {
+                            if (pos + 2 > extradata_size) {
+                                av_log(avctx, AV_LOG_ERROR, "Buffer underrun in extra nal header (%d >= %d)\n", pos + 2, extradata_size);
+                                return AVERROR_INVALIDDATA;
+                            }
+                            int nal_size = extradata[pos] << 8 | extradata[pos+1];
+                            if (pos + 2 + nal_size > extradata_size) {
+                                av_log(avctx, AV_LOG_ERROR, "Buffer underrun in extra nal (%d >= %d)\n", pos + 2 + nal_size, extradata_size);
+                                return AVERROR_INVALIDDATA;
+                            }
+                            ret = ff_libde265dec_parse_nal(avctx, extradata + pos + 2, nal_size);
+                            if (ret < 0) {
+                                return ret;
+                            }
+                            if (!ctx->probe) {
+                                err = de265_push_NAL(ctx->decoder, extradata + pos + 2, nal_size, 0, NULL);
+                                if (!de265_isOK(err)) {
+                                    av_log(avctx, AV_LOG_ERROR, "Failed to push data: %s (%d)\n", de265_get_error_text(err), err);
+                                    return AVERROR_INVALIDDATA;
+                                }
+                            }
+                            pos += 2 + nal_size;
+                        }
+                    }
+                }
+                av_log(avctx, AV_LOG_DEBUG, "Assuming packetized data (%d bytes length)\n", ctx->length_size);
+            } else {
+                ctx->packetized = 0;
+                av_log(avctx, AV_LOG_DEBUG, "Assuming non-packetized data\n");
+                // the extra data ends with a complete NAL unit
+                ret = ff_libde265dec_push_annexb(avctx, extradata, extradata_size, 0, 1);
+                if (ret >= 0) {
+                    ret = ff_libde265dec_flush_annexb(avctx);
+                }
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+            if (!ctx->probe) {
+#if LIBDE265_NUMERIC_VERSION >= 0x00070000
+                de265_push_end_of_NAL(ctx->decoder);
+#endif
+                do {
+                    err = de265_decode(ctx->decoder, &more);
+                    switch (err) {
+                    case DE265_OK:
+                        break;
+
+                    case DE265_ERROR_IMAGE_BUFFER_FULL:
+                    case DE265_ERROR_WAITING_FOR_INPUT_DATA:
+                        // not really an error
+                        more = 0;
+                        break;
+
+                    default:
+                        if (!de265_isOK(err)) {
+                            av_log(avctx, AV_LOG_ERROR, "Failed to decode extra data: %s (%d)\n", de265_get_error_text(err), err);
+                            return AVERROR_INVALIDDATA;
+                        }
+                    }
+                } while (more);
+            }
+        }
+    }
+
+    if (ctx->probe && avpkt->size == 0) {
+        // no delayed pictures when probing
+        return 0;
+    }
+
+    int skip_deblocking = (ctx->skip_deblocking == DISCARD_AUTO) ? avctx->skip_loop_filter : ctx->skip_deblocking;
+    int skip_sao = (ctx->skip_sao == DISCARD_AUTO) ? avctx->skip_loop_filter : ctx->skip_sao;
+    int inspect_nals = ctx->probe || ctx->build_index || ctx->output_format != OUTPUT_YUV ||
+                       needs_picture_info(skip_deblocking) || needs_picture_info(skip_sao);
+
+    memset(&ctx->au, 0, sizeof(ctx->au));
+    if (avpkt->size > 0) {
+        if (avpkt->pts != AV_NOPTS_VALUE) {
+            pts = avpkt->pts;
+        } else {
+            pts = avctx->reordered_opaque;
+        }
+
+        if (ctx->packetized) {
+            uint8_t* avpkt_data = avpkt->data;
+            uint8_t* avpkt_end = avpkt->data + avpkt->size;
+            while (avpkt_data + ctx->length_size <= avpkt_end) {
+                int nal_size = 0;
+                int i;
+                for (i=0; i<ctx->length_size; i++) {
+                    nal_size = (nal_size << 8) | avpkt_data[i];
+                }
+                if (nal_size > avpkt_end - avpkt_data - ctx->length_size) {
+                    av_log(avctx, AV_LOG_ERROR, "Buffer underrun in packet (%d > %d)\n",
+                           nal_size, (int) (avpkt_end - avpkt_data - ctx->length_size));
+                    return AVERROR_INVALIDDATA;
+                }
+                if (inspect_nals) {
+                    ret = ff_libde265dec_parse_nal(avctx, avpkt_data + ctx->length_size, nal_size);
+                    if (ret < 0) {
+                        return ret;
+                    }
+                }
+                if (!ctx->probe) {
+                    err = de265_push_NAL(ctx->decoder, avpkt_data + ctx->length_size, nal_size, pts, NULL);
+                    if (err != DE265_OK) {
+                        const char *error = de265_get_error_text(err);
+                        av_log(avctx, AV_LOG_ERROR, "Failed to push data: %s\n", error);
+                        return AVERROR_INVALIDDATA;
+                    }
+                }
+                avpkt_data += ctx->length_size + nal_size;
+            }
+        } else {
+            ret = ff_libde265dec_push_annexb(avctx, avpkt->data, avpkt->size, pts, inspect_nals);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        if (avpkt->pos >= 0) {
+            ctx->index_stream_pos = avpkt->pos;
+        }
+        if (ctx->build_index && ctx->index_stream_pos >= 0) {
+            ret = ff_libde265dec_update_index(ctx, ctx->index_stream_pos, avpkt->pts);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        if (ctx->index_stream_pos >= 0) {
+            ctx->index_stream_pos += avpkt->size;
+        }
+        ctx->pending_packets++;
+    } else {
+        ret = ff_libde265dec_flush_annexb(avctx);
+        if (ret < 0) {
+            return ret;
+        }
+        de265_flush_data(ctx->decoder);
+    }
+
+    if (ctx->probe) {
+        ret = ff_libde265dec_output_probe_frame(avctx, picture, got_frame, pts);
+        return ret < 0 ? ret : avpkt->size;
+    }
+
+#if LIBDE265_NUMERIC_VERSION >= 0x00070000
+    // libde265 only has decoder wide switches for the loop filters, they are
+    // updated from the pictures of every packet before decoding it. Pictures
+    // of earlier packets which are still being decoded may pick up the change.
+    if (avpkt->size > 0) {
+        update_loop_filter(ctx, DE265_DECODER_PARAM_DISABLE_DEBLOCKING, skip_deblocking, &ctx->disable_deblocking);
+        update_loop_filter(ctx, DE265_DECODER_PARAM_DISABLE_SAO, skip_sao, &ctx->disable_sao);
+    }
+    int decode_ratio = (avctx->skip_frame < AVDISCARD_NONREF) ? 100 : 0;
+    if (decode_ratio != ctx->decode_ratio) {
+        ctx->decode_ratio = decode_ratio;
+        de265_set_framerate_ratio(ctx->decoder, decode_ratio);
+    }
+#endif
+
+    // Pictures are only returned once more than "lookahead" packets are
+    // queued, so libde265 can work on the following ones in the meantime.
+    int output = (avpkt->size == 0 || ctx->pending_packets > ctx->lookahead);
+
+    // decode as much as possible up to next image
+    do {
+        more = 0;
+        err = de265_decode(ctx->decoder, &more);
+        if (err != DE265_OK) {
+            break;
+        }
+        if (output && de265_peek_next_picture(ctx->decoder) != NULL) {
+            break;
+        }
+    } while (more && err == DE265_OK);
+
+    switch (err) {
+    case DE265_OK:
+    case DE265_ERROR_IMAGE_BUFFER_FULL:
+    case DE265_ERROR_WAITING_FOR_INPUT_DATA:
+        break;
+
+    default:
+        {
+            const char *error  = de265_get_error_text(err);
+
+            av_log(avctx, AV_LOG_ERROR, "Failed to decode frame: %s\n", error);
+            return AVERROR_INVALIDDATA;
+        }
+    }
+
+    if (err == DE265_ERROR_IMAGE_BUFFER_FULL) {
+        // libde265 can't queue more pictures
+        output = 1;
+    } else if (err == DE265_ERROR_WAITING_FOR_INPUT_DATA && de265_peek_next_picture(ctx->decoder) == NULL) {
+        // All data has been decoded and no picture is waiting for output.
+        // Packets without (output) pictures, e.g. parameter sets, skipped
+        // or broken pictures, would otherwise be counted forever.
+        ctx->pending_packets = 0;
+    }
+
+    if (output && (img = de265_get_next_picture(ctx->decoder)) != NULL) {
+        int width;
         int height;
         int bits_per_pixel = LIBDE265_FFMPEG_MAX(
                                  LIBDE265_FFMPEG_MAX(
@@ -568,125 +2948,121 @@ static int ff_libde265dec_decode(AVCodecContext *avctx,
                 return AVERROR_INVALIDDATA;
             }
 
-            avcodec_set_dimensions(avctx, width, height);
+            set_dimensions(avctx, width, height);
         }
 
-#if LIBDE265_NUMERIC_VERSION >= 0x00070000
-        AVFrame *frame = (AVFrame *) de265_get_image_plane_user_data(img, 0);
-        if (frame != NULL) {
-            av_frame_ref(picture, frame);
-            if (frame->opaque) {
-                // Cropping needed.
-                struct de265_image_spec *spec = (struct de265_image_spec *) frame->opaque;
-                frame->opaque = NULL;
-                picture->width = spec->visible_width;
-                picture->height = spec->visible_height;
-                for (int i=0; i<numplanes; i++) {
-                    int shift = (i == 0) ? 0 : 1;
-                    int offset = (spec->crop_left >> shift) + (spec->crop_top >> shift) * picture->linesize[i];
-                    picture->data[i] += offset;
-                }
-                free_spec(ctx, spec);
-            }
-        } else {
-#endif
-            picture->width = avctx->width;
-            picture->height = avctx->height;
-            picture->format = avctx->pix_fmt;
-            if (avctx->get_buffer2 != NULL) {
-                ret = avctx->get_buffer2(avctx, picture, 0);
-            } else {
-                ret = av_frame_get_buffer(picture, 32);
-            }
+        if (ctx->output_format != OUTPUT_YUV) {
+            // convert directly from the decoded planes
+            avctx->pix_fmt = get_output_format(ctx->output_format);
+            ret = ff_libde265dec_convert_picture(avctx, img, picture);
             if (ret < 0) {
                 return ret;
             }
-
-            for (int i=0;i<=3;i++) {
-                if (i<numplanes) {
-                    src[i] = de265_get_image_plane(img, i, &stride[i]);
+        } else {
+#if LIBDE265_NUMERIC_VERSION >= 0x00070000
+            AVFrame *frame = (AVFrame *) de265_get_image_plane_user_data(img, 0);
+            if (frame != NULL) {
+                av_frame_ref(picture, frame);
+                ff_libde265dec_complete_ring_frame(ctx, frame, de265_get_image_PTS(img));
+                if (frame->opaque) {
+                    // Cropping needed.
+                    struct de265_image_spec *spec = (struct de265_image_spec *) frame->opaque;
+                    frame->opaque = NULL;
+                    picture->width = spec->visible_width;
+                    picture->height = spec->visible_height;
+                    for (int i=0; i<numplanes; i++) {
+                        int shift = (i == 0) ? 0 : 1;
+                        int offset = (spec->crop_left >> shift) + (spec->crop_top >> shift) * picture->linesize[i];
+                        picture->data[i] += offset;
+                    }
+                    free_spec(ctx, spec);
+                }
+            } else {
+#endif
+                picture->width = avctx->width;
+                picture->height = avctx->height;
+                picture->format = avctx->pix_fmt;
+                if (avctx->get_buffer2 != NULL) {
+                    ret = avctx->get_buffer2(avctx, picture, 0);
                 } else {
-                    src[i] = NULL;
-                    stride[i] = 0;
+                    ret = av_frame_get_buffer(picture, 32);
                 }
-            }
-
-            int equal_strides = 1;
-            for (int i=1; i<numplanes; i++) {
-                if (stride[i-1] != stride[i]) {
-                    equal_strides = 0;
-                    break;
+                if (ret < 0) {
+                    return ret;
                 }
-            }
-            if (equal_strides) {
-                // All input planes match the output planes, copy directly.
-                av_image_copy(picture->data, picture->linesize, src, stride,
-                              avctx->pix_fmt, width, height);
-            } else {
-                int max_bits_per_pixel = get_output_bits_per_pixel(format);
-                for (int i=0; i<numplanes; i++) {
-                    int plane_width = de265_get_image_width(img, i);
-                    int plane_height = de265_get_image_height(img, i);
-                    int plane_bits_per_pixel = de265_get_bits_per_pixel(img, i);
-                    int size = LIBDE265_FFMPEG_MIN(stride[i], picture->linesize[i]);
-                    uint8_t* src_ptr = (uint8_t*) src[i];
-                    uint8_t* dst_ptr = (uint8_t*) picture->data[i];
-                    if (plane_bits_per_pixel > max_bits_per_pixel) {
-                        // More bits per pixel in this plane than supported by the output format
-                        int shift = (plane_bits_per_pixel - max_bits_per_pixel);
-                        for( int line = 0; line < plane_height; line++ ) {
-                            uint16_t *s = (uint16_t *) src_ptr;
-                            uint16_t *d = (uint16_t *) dst_ptr;
-                            for (int pos=0; pos<size/2; pos++) {
-                                *d = *s >> shift;
-                                d++;
-                                s++;
-                            }
-                            src_ptr += stride[i];
-                            dst_ptr += picture->linesize[i];
-                        }
-                    } else if (plane_bits_per_pixel < max_bits_per_pixel && plane_bits_per_pixel > 8) {
-                        // Less bits per pixel in this plane than the rest of the picture
-                        // but more than 8bpp.
-                        int shift = (max_bits_per_pixel - plane_bits_per_pixel);
-                        for( int line = 0; line < plane_height; line++ ) {
-                            uint16_t *s = (uint16_t *) src_ptr;
-                            uint16_t *d = (uint16_t *) dst_ptr;
-                            for (int pos=0; pos<size/2; pos++) {
-                                *d = *s << shift;
-                                d++;
-                                s++;
-                            }
-                            src_ptr += stride[i];
-                            dst_ptr += picture->linesize[i];
-                        }
-                    } else if (plane_bits_per_pixel < max_bits_per_pixel && plane_bits_per_pixel == 8) {
-                        // 8 bits per pixel in this plane, which is less than the rest of the picture.
-                        int shift = (max_bits_per_pixel - plane_bits_per_pixel);
-                        for( int line = 0; line < plane_height; line++ ) {
-                            uint8_t *s = (uint8_t *) src_ptr;
-                            uint16_t *d = (uint16_t *) dst_ptr;
-                            for (int pos=0; pos<size; pos++) {
-                                *d = *s << shift;
-                                d++;
-                                s++;
-                            }
-                            src_ptr += stride[i];
-                            dst_ptr += picture->linesize[i];
-                        }
+
+                DE265CopyJob job;
+                job.picture = picture;
+                job.numplanes = numplanes;
+                for (int i=0;i<=3;i++) {
+                    if (i<numplanes) {
+                        src[i] = de265_get_image_plane(img, i, &stride[i]);
                     } else {
-                        // Bits per pixel of plane match output format.
-                        av_image_copy_plane(picture->data[i], picture->linesize[i],
-                                            src[i], stride[i], size, plane_height);
+                        src[i] = NULL;
+                        stride[i] = 0;
+                    }
+                    job.src[i] = src[i];
+                    job.stride[i] = stride[i];
+                }
 
+                int equal_strides = 1;
+                for (int i=1; i<numplanes; i++) {
+                    if (stride[i-1] != stride[i]) {
+                        equal_strides = 0;
+                        break;
                     }
                 }
-            }
+                if (equal_strides) {
+                    // All input planes match the output planes, copy directly.
+                    int linesizes[4];
+                    av_image_fill_linesizes(linesizes, avctx->pix_fmt, width);
+                    for (int i=0; i<numplanes; i++) {
+                        job.mode[i] = COPY_PLANE;
+                        job.shift[i] = 0;
+                        job.size[i] = linesizes[i];
+                        job.height[i] = de265_get_image_height(img, i);
+                    }
+                } else {
+                    int max_bits_per_pixel = get_output_bits_per_pixel(format);
+                    for (int i=0; i<numplanes; i++) {
+                        int plane_bits_per_pixel = de265_get_bits_per_pixel(img, i);
+                        job.size[i] = LIBDE265_FFMPEG_MIN(stride[i], picture->linesize[i]);
+                        job.height[i] = de265_get_image_height(img, i);
+                        if (plane_bits_per_pixel > max_bits_per_pixel) {
+                            // More bits per pixel in this plane than supported by the output format
+                            job.mode[i] = COPY_SHIFT_RIGHT;
+                            job.shift[i] = plane_bits_per_pixel - max_bits_per_pixel;
+                        } else if (plane_bits_per_pixel < max_bits_per_pixel && plane_bits_per_pixel > 8) {
+                            // Less bits per pixel in this plane than the rest of the picture
+                            // but more than 8bpp.
+                            job.mode[i] = COPY_SHIFT_LEFT;
+                            job.shift[i] = max_bits_per_pixel - plane_bits_per_pixel;
+                        } else if (plane_bits_per_pixel < max_bits_per_pixel && plane_bits_per_pixel == 8) {
+                            // 8 bits per pixel in this plane, which is less than the rest of the picture.
+                            job.mode[i] = COPY_EXPAND_8BIT;
+                            job.shift[i] = max_bits_per_pixel - plane_bits_per_pixel;
+                            job.size[i] = LIBDE265_FFMPEG_MIN(stride[i], picture->linesize[i] / 2);
+                        } else {
+                            // Bits per pixel of plane match output format.
+                            job.mode[i] = COPY_PLANE;
+                            job.shift[i] = 0;
+                        }
+                    }
+                }
+
+                // Split the copy into bands of rows which are processed by the
+                // slice threads of the codec context (if available).
+                job.bands = get_band_count(avctx, height);
+                avctx->execute2(avctx, ff_libde265dec_copy_band, &job, NULL, job.bands);
 #if LIBDE265_NUMERIC_VERSION >= 0x00070000
-        }
+            }
 #endif
+        }
 
         *got_frame = 1;
+        if (ctx->pending_packets > 0) {
+            ctx->pending_packets--;
+        }
 
         picture->reordered_opaque = de265_get_image_PTS(img);
         picture->pkt_pts = de265_get_image_PTS(img);
@@ -699,6 +3075,20 @@ static av_cold int ff_libde265dec_free(AVCodecContext *avctx)
 {
     DE265Context *ctx = (DE265Context *) avctx->priv_data;
     de265_free_decoder(ctx->decoder);
+    av_frame_free(&ctx->probe_frame);
+    av_freep(&ctx->rbsp_buffer);
+    ctx->rbsp_buffer_size = 0;
+    av_freep(&ctx->convert_buffer);
+    ctx->convert_buffer_size = 0;
+    av_freep(&ctx->nal_buffer);
+    ctx->nal_buffer_size = 0;
+    av_freep(&ctx->index);
+    ctx->index_size = 0;
+    ctx->index_count = 0;
+    // frames still referencing ring slots keep the slot state alive
+    av_buffer_unref(&ctx->ring_state);
+    ctx->ring = NULL;
+    ctx->ring_count = 0;
 #if LIBDE265_NUMERIC_VERSION >= 0x00070000
     while (ctx->frame_queue_len) {
         AVFrame *frame = ctx->frame_queue[--ctx->frame_queue_len];
@@ -717,21 +3107,48 @@ static av_cold void ff_libde265dec_flush(AVCodecContext *avctx)
 {
     DE265Context *ctx = (DE265Context *) avctx->priv_data;
     de265_reset(ctx->decoder);
+    ctx->pending_packets = 0;
+    ctx->nal_pending = 0;
+    ctx->nal_buffer_len = 0;
+    // the following packets might come from anywhere in the stream
+    ctx->index_stream_pos = -1;
 }
 
 
 static av_cold void ff_libde265dec_static_init(struct AVCodec *codec)
 {
-    // No initialization required
+#if HAVE_AVX2_INTRINSICS
+    if (av_get_cpu_flags() & AV_CPU_FLAG_AVX2) {
+        find_start_code = find_start_code_avx2;
+    }
+#endif
 }
 
 
 static av_cold int ff_libde265dec_ctx_init(AVCodecContext *avctx)
 {
     DE265Context *ctx = (DE265Context *) avctx->priv_data;
+#if !HAVE_FLOAT_OUTPUT
+    if (ctx->output_format == OUTPUT_GBRPF32) {
+        av_log(avctx, AV_LOG_ERROR, "Planar float output requires a newer libavutil\n");
+        return AVERROR(ENOSYS);
+    }
+#endif
+#if !HAVE_HUGE_PAGES
+    if (ctx->huge_pages != HUGE_PAGES_OFF) {
+        av_log(avctx, AV_LOG_WARNING, "Huge pages are not supported on this platform\n");
+    }
+#endif
     ctx->decoder = de265_new_decoder();
-    // XXX: always decode multiple threads for now
-    if (1 || avctx->active_thread_type & FF_THREAD_SLICE) {
+    if (ctx->probe) {
+        // pictures are never decoded, no need for worker threads
+        ctx->probe_frame = av_frame_alloc();
+        if (ctx->probe_frame == NULL) {
+            de265_free_decoder(ctx->decoder);
+            return AVERROR(ENOMEM);
+        }
+    } else if (1 || avctx->active_thread_type & FF_THREAD_SLICE) {
+        // XXX: always decode multiple threads for now
         int threads = avctx->thread_count;
         if (threads <= 0) {
             threads = av_cpu_count();
@@ -757,8 +3174,10 @@ static av_cold int ff_libde265dec_ctx_init(AVCodecContext *avctx)
     ctx->check_extra = 1;
     ctx->packetized = 1;
     ctx->length_size = 4;
+    ctx->pending_packets = 0;
 #if LIBDE265_NUMERIC_VERSION >= 0x00070000
-    ctx->deblocking = 1;
+    ctx->disable_deblocking = 0;
+    ctx->disable_sao = 0;
     ctx->decode_ratio = 100;
     ctx->frame_queue_len = 0;
     ctx->spec_queue_len = 0;
@@ -789,6 +3208,27 @@ static void ff_libde265dec_unregister_codecs(enum AVCodecID id)
 }
 
 
+#define OFFSET(x) offsetof(DE265Context, x)
+#define VD (AV_OPT_FLAG_VIDEO_PARAM | AV_OPT_FLAG_DECODING_PARAM)
+
+static AVOption *add_option(AVOption *option, const char *name, const char *help, int offset,
+                            enum AVOptionType type, int64_t value, double min, double max, const char *unit)
+{
+    option->name = name;
+    option->help = help;
+    option->offset = offset;
+    option->type = type;
+    option->default_val.i64 = value;
+    option->min = min;
+    option->max = max;
+    option->flags = VD;
+    option->unit = unit;
+    return option + 1;
+}
+
+static AVOption ff_libde265dec_options[MAX_OPTIONS];
+static AVClass ff_libde265dec_class;
+
 AVCodec ff_libde265_decoder;
 
 void libde265dec_register(void)
@@ -801,11 +3241,67 @@ void libde265dec_register(void)
 
     registered = 1;
     ff_libde265dec_unregister_codecs(AV_CODEC_ID_HEVC);
+
+    // The last entry is kept zeroed to terminate the list.
+    memset(ff_libde265dec_options, 0, sizeof(ff_libde265dec_options));
+    AVOption *option = ff_libde265dec_options;
+    option = add_option(option, "probe", "Only parse parameter sets and SEI, never reconstruct pictures",
+                        OFFSET(probe), AV_OPT_TYPE_INT, 0, 0, 1, NULL);
+    option = add_option(option, "hugepages", "Back decoded pictures with huge pages (replaces the default get_buffer2)",
+                        OFFSET(huge_pages), AV_OPT_TYPE_INT, HUGE_PAGES_OFF, HUGE_PAGES_OFF, HUGE_PAGES_EXPLICIT, "hugepages");
+    option = add_option(option, "off", "Regular heap allocations",
+                        0, AV_OPT_TYPE_CONST, HUGE_PAGES_OFF, 0, 0, "hugepages");
+    option = add_option(option, "transparent", "Transparent huge pages (madvise)",
+                        0, AV_OPT_TYPE_CONST, HUGE_PAGES_TRANSPARENT, 0, 0, "hugepages");
+    option = add_option(option, "explicit", "Reserved huge pages (MAP_HUGETLB), transparent ones if exhausted",
+                        0, AV_OPT_TYPE_CONST, HUGE_PAGES_EXPLICIT, 0, 0, "hugepages");
+    option = add_option(option, "lookahead", "Number of packets to queue in libde265 before returning pictures",
+                        OFFSET(lookahead), AV_OPT_TYPE_INT, 0, 0, MAX_LOOKAHEAD, NULL);
+    option = add_option(option, "index", "Record IRAP pictures and parameter set changes for seeking",
+                        OFFSET(build_index), AV_OPT_TYPE_INT, 0, 0, 1, NULL);
+    option = add_option(option, "output", "Pixel format of the returned pictures",
+                        OFFSET(output_format), AV_OPT_TYPE_INT, OUTPUT_YUV, OUTPUT_YUV, OUTPUT_GBRPF32, "output");
+    option = add_option(option, "yuv", "Decoded YUV / gray pictures", 0, AV_OPT_TYPE_CONST, OUTPUT_YUV, 0, 0, "output");
+    option = add_option(option, "rgb24", "Packed 8 bit RGB", 0, AV_OPT_TYPE_CONST, OUTPUT_RGB24, 0, 0, "output");
+#if HAVE_FLOAT_OUTPUT
+    option = add_option(option, "gbrpf32", "Planar float RGB in the range 0 - 1", 0, AV_OPT_TYPE_CONST, OUTPUT_GBRPF32, 0, 0, "output");
+#endif
+    option = add_option(option, "matrix", "YUV to RGB conversion matrix",
+                        OFFSET(matrix), AV_OPT_TYPE_INT, MATRIX_AUTO, MATRIX_AUTO, MATRIX_BT2020, "matrix");
+    option = add_option(option, "auto", "From the stream or the picture size", 0, AV_OPT_TYPE_CONST, MATRIX_AUTO, 0, 0, "matrix");
+    option = add_option(option, "bt601", "ITU-R BT.601", 0, AV_OPT_TYPE_CONST, MATRIX_BT601, 0, 0, "matrix");
+    option = add_option(option, "bt709", "ITU-R BT.709", 0, AV_OPT_TYPE_CONST, MATRIX_BT709, 0, 0, "matrix");
+    option = add_option(option, "bt2020", "ITU-R BT.2020 non-constant luminance", 0, AV_OPT_TYPE_CONST, MATRIX_BT2020, 0, 0, "matrix");
+    option = add_option(option, "range", "YUV range for the RGB conversion",
+                        OFFSET(range), AV_OPT_TYPE_INT, RANGE_AUTO, RANGE_AUTO, RANGE_FULL, "range");
+    option = add_option(option, "auto", "From the stream", 0, AV_OPT_TYPE_CONST, RANGE_AUTO, 0, 0, "range");
+    option = add_option(option, "limited", "Limited (TV) range", 0, AV_OPT_TYPE_CONST, RANGE_LIMITED, 0, 0, "range");
+    option = add_option(option, "full", "Full (PC) range", 0, AV_OPT_TYPE_CONST, RANGE_FULL, 0, 0, "range");
+    option = add_option(option, "skip_deblock", "Skip the deblocking filter for the selected pictures",
+                        OFFSET(skip_deblocking), AV_OPT_TYPE_INT, DISCARD_AUTO, DISCARD_AUTO, AVDISCARD_ALL, "discard");
+    option = add_option(option, "skip_sao", "Skip the sample adaptive offset filter for the selected pictures",
+                        OFFSET(skip_sao), AV_OPT_TYPE_INT, DISCARD_AUTO, DISCARD_AUTO, AVDISCARD_ALL, "discard");
+    option = add_option(option, "auto", "Use skip_loop_filter", 0, AV_OPT_TYPE_CONST, DISCARD_AUTO, 0, 0, "discard");
+    option = add_option(option, "none", "No pictures", 0, AV_OPT_TYPE_CONST, AVDISCARD_NONE, 0, 0, "discard");
+    option = add_option(option, "default", "No pictures", 0, AV_OPT_TYPE_CONST, AVDISCARD_DEFAULT, 0, 0, "discard");
+    option = add_option(option, "nonref", "Non-reference pictures", 0, AV_OPT_TYPE_CONST, AVDISCARD_NONREF, 0, 0, "discard");
+    option = add_option(option, "bidir", "Bidirectionally predicted pictures", 0, AV_OPT_TYPE_CONST, AVDISCARD_BIDIR, 0, 0, "discard");
+    option = add_option(option, "nonintra", "All pictures except intra pictures", 0, AV_OPT_TYPE_CONST, AVDISCARD_NONINTRA, 0, 0, "discard");
+    option = add_option(option, "nonkey", "All pictures except IRAP pictures", 0, AV_OPT_TYPE_CONST, AVDISCARD_NONKEY, 0, 0, "discard");
+    option = add_option(option, "all", "All pictures", 0, AV_OPT_TYPE_CONST, AVDISCARD_ALL, 0, 0, "discard");
+
+    memset(&ff_libde265dec_class, 0, sizeof(AVClass));
+    ff_libde265dec_class.class_name = "libde265";
+    ff_libde265dec_class.item_name  = av_default_item_name;
+    ff_libde265dec_class.option     = ff_libde265dec_options;
+    ff_libde265dec_class.version    = LIBAVUTIL_VERSION_INT;
+
     memset(&ff_libde265_decoder, 0, sizeof(AVCodec));
     ff_libde265_decoder.name           = "libde265";
     ff_libde265_decoder.type           = AVMEDIA_TYPE_VIDEO;
     ff_libde265_decoder.id             = AV_CODEC_ID_HEVC;
     ff_libde265_decoder.priv_data_size = sizeof(DE265Context);
+    ff_libde265_decoder.priv_class     = &ff_libde265dec_class;
     ff_libde265_decoder.init_static_data = ff_libde265dec_static_init;
     ff_libde265_decoder.init           = ff_libde265dec_ctx_init;
     ff_libde265_decoder.close          = ff_libde265dec_free;
@@ -37,8 +37,142 @@ extern "C" {
 
 extern AVCodec ff_libde265_decoder;
 
+/**
+ * Picture decoded into a slot of the ring set with libde265dec_set_ring.
+ */
+typedef struct LibDe265DecRingFrame {
+    int slot;
+    int64_t pts;
+    // visible size of the picture
+    int width;
+    int height;
+    // position of the visible area in the slot in pixels
+    int crop_left;
+    int crop_top;
+} LibDe265DecRingFrame;
+
+#define LIBDE265DEC_INDEX_IRAP                      1
+// the packet carries parameter sets
+#define LIBDE265DEC_INDEX_PARAMETER_SETS            2
+// the packet carries parameter sets that differ from the previous ones
+#define LIBDE265DEC_INDEX_PARAMETER_SETS_CHANGED    4
+
+/**
+ * Random access point recorded with the "index" option.
+ */
+typedef struct LibDe265DecIndexEntry {
+    // byte position of the packet, see libde265dec_get_index
+    int64_t pos;
+    // pts of the packet, may be AV_NOPTS_VALUE
+    int64_t pts;
+    // type of the first picture in the packet, -1 if there is no picture
+    int nal_unit_type;
+    // combination of LIBDE265DEC_INDEX_* flags
+    int flags;
+} LibDe265DecIndexEntry;
+
 void libde265dec_register(void);
 
+/**
+ * Set a buffer of "count" pictures of "width" x "height" pixels that
+ * pictures converted to planar float ("output" option "gbrpf32") are
+ * written to instead of allocating frames. Every picture is stored as
+ * separate R, G and B planes (NCHW layout), the slots are filled in
+ * output order and reused after "count" pictures. The returned frames
+ * point into the buffer, which must stay valid until the decoder is
+ * closed or another buffer is set. Pass NULL to disable.
+ *
+ * @return 0 on success, a negative AVERROR code on failure
+ */
+int libde265dec_set_batch_buffer(AVCodecContext *avctx, float *buffer, int width, int height, int count);
+
+/**
+ * Set a ring of "count" (up to 64) application owned buffers libde265
+ * decodes pictures into. Every slot holds a picture of at most "width" x
+ * "height" pixels in "format" with the given linesizes, the planes follow
+ * each other as laid out by av_image_fill_pointers. Slots and linesizes
+ * should be aligned to 64 bytes, pictures that don't fit into the ring
+ * are decoded into regular buffers. Linesizes must be large enough for
+ * "width" pixels. Pass NULL / 0 to remove the ring, which fails with
+ * AVERROR(EBUSY) while slots are in use. A failed call keeps the current
+ * ring.
+ *
+ * Decoding continues to return frames, which reference the slots and may
+ * be kept after the decoder is closed, the slot buffers must stay valid
+ * until they are unreferenced. The ring functions must be called from the
+ * thread that runs the decoder, the frames may be unreferenced on any thread.
+ *
+ * @return 0 on success, a negative AVERROR code on failure
+ */
+int libde265dec_set_ring(AVCodecContext *avctx, uint8_t *const *slots, int count,
+                         int width, int height, enum AVPixelFormat format, const int linesizes[4]);
+
+/**
+ * Get up to "max_frames" slots that contain completely decoded pictures,
+ * in output order. The slots are not reused until they have been released
+ * with libde265dec_release_ring_slot and the frames returned by the decoder
+ * for them have been unreferenced.
+ *
+ * @return number of frames stored in "frames", a negative AVERROR code on failure
+ */
+int libde265dec_receive_ring_frames(AVCodecContext *avctx, LibDe265DecRingFrame *frames, int max_frames);
+
+/**
+ * Release a slot returned by libde265dec_receive_ring_frames.
+ *
+ * @return 0 on success, a negative AVERROR code on failure
+ */
+int libde265dec_release_ring_slot(AVCodecContext *avctx, int slot);
+
+/**
+ * Get the random access index built while decoding with the "index"
+ * option. Entries are sorted by position and mark packets that start IRAP
+ * pictures and / or carry parameter sets. Positions are taken
+ * from AVPacket.pos, or count the bytes of all packets passed to the
+ * decoder if that is not set. After flushing (seeking), packets without
+ * position are not recorded until libde265dec_set_index_position is
+ * called. Parameter sets from the extra data are not recorded.
+ *
+ * The returned array is valid until the next decode call.
+ *
+ * @return number of entries, a negative AVERROR code on failure
+ */
+int libde265dec_get_index(AVCodecContext *avctx, const LibDe265DecIndexEntry **entries);
+
+/**
+ * Set the stream position of the next packet for the index, e.g. after
+ * seeking in a stream whose packets have no position.
+ *
+ * @return 0 on success, a negative AVERROR code on failure
+ */
+int libde265dec_set_index_position(AVCodecContext *avctx, int64_t pos);
+
+/**
+ * Find the IRAP entry with the largest pts at or before "pts". Decoding
+ * must start at the last entry with LIBDE265DEC_INDEX_PARAMETER_SETS at
+ * or before the returned one if it doesn't have that flag.
+ *
+ * @return index of the entry, AVERROR(ENOENT) if there is none
+ */
+int libde265dec_find_index_entry(AVCodecContext *avctx, int64_t pts);
+
+/**
+ * Serialize the index in a compact binary format. "data" must be freed
+ * with av_free.
+ *
+ * @return 0 on success, a negative AVERROR code on failure
+ */
+int libde265dec_export_index(AVCodecContext *avctx, uint8_t **data, int *size);
+
+/**
+ * Load an index exported with libde265dec_export_index, e.g. by an
+ * earlier session for the same stream. Entries are merged with the
+ * current index.
+ *
+ * @return 0 on success, a negative AVERROR code on failure
+ */
+int libde265dec_import_index(AVCodecContext *avctx, const uint8_t *data, int size);
+
 #ifdef __cplusplus
 }
 #endif